@@ -0,0 +1,54 @@
+#include <iostream>
+#include "bench.hpp"
+#include "imports.hpp"
+
+constexpr int ITERATIONS = 1000000;
+
+#ifdef _WIN32
+void Report(const char* name, double before, double after) {
+	std::cout << name << ": " << before << " ns -> " << after << " ns per call" << std::endl;
+}
+
+void BenchImports() {
+	ResolveImports();
+
+	// Every LI_FN call walks the loaded modules and their exports before it can call anything
+	double before = Measure(ITERATIONS, [] { return reinterpret_cast<uintptr_t>(LI_FN(GetModuleHandleA)(nullptr)); });
+	double after = Measure(ITERATIONS, [] { return reinterpret_cast<uintptr_t>(VM_IMPORT(GetModuleHandleA, GetModuleHandleA)(nullptr)); });
+	Report("GetModuleHandleA", before, after);
+
+	before = Measure(ITERATIONS, [] {
+		void* memory = LI_FN(calloc)(1, 64);
+		LI_FN(free)(memory);
+		return reinterpret_cast<uintptr_t>(memory);
+	});
+	after = Measure(ITERATIONS, [] {
+		void* memory = VM_IMPORT(Calloc, calloc)(1, 64);
+		VM_IMPORT(Free, free)(memory);
+		return reinterpret_cast<uintptr_t>(memory);
+	});
+	Report("calloc + free", before, after);
+}
+#else
+// Imports are only resolved through the slot table on Windows
+void BenchImports() {
+}
+#endif
+
+int main() {
+	// Only does anything when the JIT is built in, a translated region that differs from the interpreter fails the run
+	if (!CheckJit()) {
+		return 1;
+	}
+
+	// Crashes instead of failing when dispatching grows the stack, run it from a Debug build to check without optimizations
+	if (!CheckLoop()) {
+		return 1;
+	}
+
+	BenchImports();
+	BenchHandlers();
+	BenchThreads();
+	BenchPages();
+	return 0;
+}
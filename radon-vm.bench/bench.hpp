@@ -0,0 +1,134 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include "vm.hpp"
+
+// Keeps the results alive so the measured work is not optimized out
+inline volatile uintptr_t sink;
+
+// Runs the function the given number of times and returns the average time of a run in nanoseconds
+template<typename Function>
+double Measure(int iterations, Function function) {
+	auto start = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < iterations; i++) {
+		sink = function();
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+// Builds a blob in the variable format with an identity opcode mapping
+struct Bytecode {
+	std::vector<uint8_t> bytes;
+
+	Bytecode() : bytes(VM_HEADER_SIZE) {
+		for (int opcode = 0; opcode < static_cast<int>(VMOpcode::Count); opcode++) {
+			bytes[opcode] = static_cast<uint8_t>(opcode);
+		}
+		bytes[VM_HEADER_FORMAT] = static_cast<uint8_t>(VMFormat::Variable);
+	}
+
+	// Appends [length] followed by the fields encrypted with the low byte of the entry index
+	int Entry(const std::vector<uint8_t>& fields) {
+		int index = static_cast<int>(bytes.size());
+		bytes.push_back(static_cast<uint8_t>(fields.size()));
+
+		for (uint8_t field : fields) {
+			bytes.push_back(field ^ static_cast<uint8_t>(index));
+		}
+		return index;
+	}
+
+	// Nothing may be added after this since the runtime keeps the pointer
+	uint8_t* Finish() {
+		return bytes.data();
+	}
+};
+
+inline void Append(std::vector<uint8_t>& fields, std::initializer_list<uint8_t> values) {
+	for (uint8_t value : values) {
+		fields.push_back(value);
+	}
+}
+
+inline void Append(std::vector<uint8_t>& fields, uint64_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		fields.push_back(static_cast<uint8_t>(value >> (i * 8)));
+	}
+}
+
+inline void AppendRegister(std::vector<uint8_t>& fields, uint8_t size, uint8_t reg) {
+	Append(fields, { static_cast<uint8_t>(VMOpKind::Register), size, reg, static_cast<uint8_t>(VMRegisterPart::Lower) });
+}
+
+// Every memory operand is [rdi]
+inline void AppendMemory(std::vector<uint8_t>& fields, uint8_t size) {
+	Append(fields, { static_cast<uint8_t>(VMOpKind::Memory), size, RDI, 0xFF, 0 });
+	Append(fields, 0, sizeof(int32_t));
+}
+
+inline void AppendImmediate(std::vector<uint8_t>& fields, uint8_t size, uint64_t value) {
+	Append(fields, { static_cast<uint8_t>(VMOpKind::Immediate32), size });
+	Append(fields, value, sizeof(uint64_t));
+}
+
+// Encodes the math variant as [opcode] [operand count] with rax or [rdi] as the destination and rcx, [rdi] or 1 as the source
+inline std::vector<uint8_t> Math(int variant) {
+	VMShape shape = static_cast<VMShape>(variant / 4 % static_cast<int>(VMShape::Count));
+	uint8_t size = static_cast<uint8_t>(1 << (variant % 4));
+
+	std::vector<uint8_t> fields = { static_cast<uint8_t>(static_cast<int>(VMOpcode::Math) + variant), 2 };
+
+	if (shape == VMShape::MemoryRegister || shape == VMShape::MemoryImmediate) {
+		AppendMemory(fields, size);
+	}
+	else {
+		AppendRegister(fields, size, RAX);
+	}
+
+	if (shape == VMShape::RegisterRegister || shape == VMShape::MemoryRegister) {
+		AppendRegister(fields, size, RCX);
+	}
+	else if (shape == VMShape::RegisterMemory) {
+		AppendMemory(fields, size);
+	}
+	else {
+		AppendImmediate(fields, size, 1);
+	}
+	return fields;
+}
+
+// Names the math variant the way profiles do, e.g. Add.RegisterImmediate.4
+inline std::string VariantName(int variant) {
+	const char* operations[] = { "Add", "Sub", "Cmp", "Mov" };
+	const char* shapes[] = { "RegisterRegister", "RegisterMemory", "RegisterImmediate", "MemoryRegister", "MemoryImmediate" };
+
+	return std::string(operations[variant / 4 / static_cast<int>(VMShape::Count)]) + "." + shapes[variant / 4 % static_cast<int>(VMShape::Count)] + "." + std::to_string(1 << (variant % 4));
+}
+
+// [opcode] [operand count] with a register destination and an immediate source
+inline std::vector<uint8_t> RegisterImmediate(MathOperation operation, uint8_t size, uint8_t reg, uint64_t value) {
+	std::vector<uint8_t> fields = { static_cast<uint8_t>(MathOpcode(operation, VMShape::RegisterImmediate, size)), 2 };
+	AppendRegister(fields, size, reg);
+	AppendImmediate(fields, size, value);
+	return fields;
+}
+
+inline std::vector<uint8_t> Branch(VMOpcode opcode, VMCondition condition, int target) {
+	std::vector<uint8_t> fields = { static_cast<uint8_t>(opcode), 1 };
+	Append(fields, { static_cast<uint8_t>(VMOpKind::NearBranch64), static_cast<uint8_t>(condition) });
+	Append(fields, static_cast<uint32_t>(target), sizeof(int32_t));
+	return fields;
+}
+
+bool CheckJit();
+bool CheckLoop();
+void BenchImports();
+void BenchHandlers();
+void BenchThreads();
+void BenchPages();
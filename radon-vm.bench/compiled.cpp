@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <vector>
+#include "bench.hpp"
+#include "jit.hpp"
+
+#if VM_JIT_THRESHOLD
+namespace {
+	// Arithmetic flags, the only ones either side changes
+	constexpr uint64_t FLAGS = 0x8D5;
+
+	constexpr int ITERATIONS = 10;
+
+	// Registers and [rdi] every region starts from, picked so adds and subs carry and overflow at every operand size
+	struct Seed {
+		uint64_t rax;
+		uint64_t rcx;
+		uint64_t memory;
+	};
+
+	constexpr Seed Seeds[] = {
+		{ 0x7FFFFFFFFFFFFFFF, 0x0000000000000001, 0x8000000080008080 },
+		{ 0x0000000000000080, 0xFFFFFFFFFFFFFF80, 0x00000000FFFFFFFF },
+		{ 0x0000000000000000, 0x0000000000000000, 0x0000000000000000 }
+	};
+
+	struct Result {
+		VMState state;
+		uint64_t memory;
+	};
+
+	struct Region {
+		std::string name;
+		int seed;
+		int index;
+	};
+
+	Result Run(uint8_t* blob, int index, const Seed& seed) {
+		alignas(16) static uint64_t memory[2];
+		memory[0] = seed.memory;
+
+		Result result{};
+		VMState& state = result.state;
+
+		for (int i = 0; i < 16; i++) {
+			state.registers[i] = 0x0101010101010101 * i;
+		}
+		state.rax = seed.rax;
+		state.rcx = seed.rcx;
+		state.rdi = reinterpret_cast<uint64_t>(memory);
+		state.rflags = 0x202;
+
+		VMDispatcher(&state, blob, index);
+		result.memory = memory[0];
+		return result;
+	}
+
+	bool Matches(const Region& region, const Result& interpreted, const Result& translated) {
+		bool matches = true;
+
+		auto Compare = [&](const char* what, uint64_t expected, uint64_t actual) {
+			if (expected != actual) {
+				std::printf("%s (seed %d): %s is %016llx, the interpreter gives %016llx\n", region.name.c_str(), region.seed, what,
+					static_cast<unsigned long long>(actual), static_cast<unsigned long long>(expected));
+				matches = false;
+			}
+		};
+
+		const char* names[] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+
+		for (int i = 0; i < 16; i++) {
+			Compare(names[i], interpreted.state.registers[i], translated.state.registers[i]);
+		}
+		Compare("rflags", interpreted.state.rflags & FLAGS, translated.state.rflags & FLAGS);
+		Compare("rip", interpreted.state.rip, translated.state.rip);
+		Compare("[rdi]", interpreted.memory, translated.memory);
+		return matches;
+	}
+}
+
+// Runs every math variant and a Jcc loop interpreted until the JIT translates them, then compares the native run against
+// the last interpreted one. Regions the JIT leaves to the interpreter are reported but are not a failure
+bool CheckJit() {
+	if (VM_JIT_THRESHOLD < 2) {
+		std::printf("JIT check skipped, it needs VM_JIT_THRESHOLD of at least 2 to see a region interpreted first\n");
+		return true;
+	}
+
+	constexpr int VARIANTS = static_cast<int>(VMOpcode::Fused) - static_cast<int>(VMOpcode::Math);
+
+	// One blob for every region, the slots of the regions only stay apart while the whole blob fits in VM_JIT_REGIONS bytes
+	Bytecode bytecode;
+	std::vector<Region> regions;
+
+	for (int seed = 0; seed < static_cast<int>(sizeof(Seeds) / sizeof(Seeds[0])); seed++) {
+		for (int variant = 0; variant < VARIANTS; variant++) {
+			regions.push_back({ VariantName(variant), seed, bytecode.Entry(Math(variant)) });
+			bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+		}
+
+		int start = bytecode.Entry(RegisterImmediate(MathOperation::Mov, 4, RCX, ITERATIONS));
+		int loop = bytecode.Entry(RegisterImmediate(MathOperation::Add, 8, RAX, 3));
+		bytecode.Entry(RegisterImmediate(MathOperation::Sub, 4, RCX, 1));
+		bytecode.Entry(Branch(VMOpcode::Jcc, VMCondition::NE, loop));
+		bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+		regions.push_back({ "Jcc loop", seed, start });
+	}
+
+	uint8_t* blob = bytecode.Finish();
+
+	if (bytecode.bytes.size() > VM_JIT_REGIONS) {
+		std::printf("JIT check needs VM_JIT_REGIONS of at least %zu\n", bytecode.bytes.size());
+		return false;
+	}
+
+	int compiled = 0;
+	int mismatches = 0;
+
+	for (const Region& region : regions) {
+		Result interpreted{};
+
+		for (int run = 1; run < VM_JIT_THRESHOLD; run++) {
+			interpreted = Run(blob, region.index, Seeds[region.seed]);
+		}
+
+		Result translated = Run(blob, region.index, Seeds[region.seed]);
+		VMJitRegion& slot = GetRegion(blob, region.index);
+
+		if (slot.tag.load() != reinterpret_cast<uintptr_t>(blob) + region.index || slot.state.load() != VMJitState::Compiled) {
+			continue;
+		}
+
+		compiled++;
+
+		if (!Matches(region, interpreted, translated)) {
+			mismatches++;
+		}
+	}
+
+	std::printf("JIT check: %d of %zu regions translated, %d differ from the interpreter\n", compiled, regions.size(), mismatches);
+	return mismatches == 0;
+}
+#else
+// Nothing is translated without a threshold
+bool CheckJit() {
+	return true;
+}
+#endif
@@ -0,0 +1,224 @@
+#include <cstdio>
+#include <vector>
+#include "bench.hpp"
+#include "imports.hpp"
+#include "jit.hpp"
+
+namespace {
+	constexpr int RUNS = 200000;
+
+	// Instructions per region, kept small so every region stays within a few cache lines
+	constexpr int COPIES = 8;
+
+	// Instructions per native function
+	constexpr int NATIVE_COPIES = 64;
+
+	// Emits the native equivalent of the math variant on the same operands, rdi holds the first argument
+	void EmitNative(VMJitEmitter& emitter, int variant) {
+		// Opcodes of the [r/m], reg and reg, [r/m] forms and the ModRM digit of the immediate form for Add, Sub, Cmp and Mov
+		constexpr uint8_t store[] = { 0x01, 0x29, 0x39, 0x89 };
+		constexpr uint8_t load[] = { 0x03, 0x2B, 0x3B, 0x8B };
+		constexpr uint8_t digit[] = { 0, 5, 7, 0 };
+
+		MathOperation operation = static_cast<MathOperation>(variant / 4 / static_cast<int>(VMShape::Count));
+		VMShape shape = static_cast<VMShape>(variant / 4 % static_cast<int>(VMShape::Count));
+		uint8_t size = static_cast<uint8_t>(1 << (variant % 4));
+		uint8_t narrow = (size == 1) ? 1 : 0;
+
+		EmitPrefix(emitter, size, false);
+
+		switch (shape) {
+		case VMShape::RegisterRegister:
+			emitter.Byte(store[static_cast<int>(operation)] - narrow);
+			emitter.Byte(0xC8);
+			break;
+		case VMShape::RegisterMemory:
+			emitter.Byte(load[static_cast<int>(operation)] - narrow);
+			emitter.Byte(0x07);
+			break;
+		case VMShape::MemoryRegister:
+			emitter.Byte(store[static_cast<int>(operation)] - narrow);
+			emitter.Byte(0x0F);
+			break;
+		default:
+			emitter.Byte((operation == MathOperation::Mov ? 0xC7 : 0x81) - narrow);
+			emitter.Byte((shape == VMShape::RegisterImmediate ? 0xC0 : 0x07) | (digit[static_cast<int>(operation)] << 3));
+			for (int i = 0; i < (size < 4 ? size : 4); i++) {
+				emitter.Byte(i == 0 ? 1 : 0);
+			}
+			break;
+		}
+	}
+
+	using NativeFunction = uintptr_t(*)(uint64_t* memory);
+
+	// Whether the region runs as translated code, only a JIT build translates anything and only once its slot is free
+	bool Translated(uint8_t* blob, int index) {
+#if VM_JIT_THRESHOLD
+		VMJitRegion& region = GetRegion(blob, index);
+		return region.tag.load() == reinterpret_cast<uintptr_t>(blob) + index && region.state.load() == VMJitState::Compiled;
+#else
+		(void)blob;
+		(void)index;
+		return false;
+#endif
+	}
+
+	const char* TierName(bool translated) {
+		return translated ? "translated" : "interpreted";
+	}
+
+	// Builds a function running the variant NATIVE_COPIES times, a negative variant gives an empty function
+	NativeFunction Native(uint8_t* code, int variant) {
+		VMJitEmitter emitter{ code, 0, false };
+
+#ifdef _WIN32
+		// push rdi, mov rdi, rcx
+		emitter.Byte(0x57);
+		emitter.Byte(0x48);
+		emitter.Byte(0x89);
+		emitter.Byte(0xCF);
+#endif
+
+		for (int i = 0; i < NATIVE_COPIES && variant >= 0; i++) {
+			EmitNative(emitter, variant);
+		}
+
+#ifdef _WIN32
+		// pop rdi
+		emitter.Byte(0x5F);
+#endif
+		emitter.Byte(0xC3);
+
+		if (emitter.overflow || !SealCode(code, VM_JIT_BUFFER_SIZE)) {
+			return nullptr;
+		}
+		return reinterpret_cast<NativeFunction>(code);
+	}
+
+#ifndef _WIN32
+	// Call site of the System V backend, mov rax, VMEnter and call rax followed by the bytecode and index, then ret
+	NativeFunction Enter(uint8_t* code, uint8_t* blob, int index) {
+		VMJitEmitter emitter{ code, 0, false };
+		emitter.Byte(0x48);
+		emitter.Byte(0xB8);
+		emitter.Qword(reinterpret_cast<uint64_t>(&VMEnter));
+		emitter.Byte(0xFF);
+		emitter.Byte(0xD0);
+		emitter.Qword(reinterpret_cast<uint64_t>(blob));
+		emitter.Dword(static_cast<uint32_t>(index));
+		emitter.Byte(0xC3);
+
+		if (emitter.overflow || !SealCode(code, VM_JIT_BUFFER_SIZE)) {
+			return nullptr;
+		}
+		return reinterpret_cast<NativeFunction>(code);
+	}
+#endif
+}
+
+// Times every math handler through VMDispatcher against the native instruction it replaces
+void BenchHandlers() {
+	constexpr int VARIANTS = static_cast<int>(VMOpcode::Fused) - static_cast<int>(VMOpcode::Math);
+
+	ResolveImports();
+
+	// Every region lives in one blob, a thread moving on to another blob starts its cache over
+	// The empty region comes first, its JIT slot is then only shared if the blob outgrows VM_JIT_REGIONS
+	Bytecode bytecode;
+	int exit = bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+	int regions[VARIANTS];
+
+	for (int variant = 0; variant < VARIANTS; variant++) {
+		regions[variant] = bytecode.Entry(Math(variant));
+
+		for (int i = 1; i < COPIES; i++) {
+			bytecode.Entry(Math(variant));
+		}
+		bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+	}
+
+	uint8_t* blob = bytecode.Finish();
+
+	alignas(16) static uint64_t memory[2];
+	VMState state{};
+	state.rax = 1;
+	state.rcx = 2;
+	state.rdi = reinterpret_cast<uint64_t>(memory);
+
+	auto Run = [&](int index) {
+		return Measure(RUNS, [&] {
+			VMDispatcher(&state, blob, index);
+			return static_cast<uintptr_t>(state.rax);
+		});
+	};
+
+	// Measured first so the runtime setup does not count towards the first handler
+	Run(exit);
+	double activation = Run(exit);
+	bool translated = Translated(blob, exit);
+
+	uint8_t* code = AllocateCode(VM_JIT_BUFFER_SIZE);
+
+	if (!code) {
+		std::printf("Failed to allocate native code\n");
+		return;
+	}
+
+	NativeFunction empty = Native(code, -1);
+	double baseline = Measure(RUNS, [&] { return empty(memory); });
+
+	std::printf("%-28s %-12s %10s %10s %10s %8s\n", "Handler", "Tier", "Run ns", "VM ns", "Native ns", "Ratio");
+
+	for (int variant = 0; variant < VARIANTS; variant++) {
+		// The empty region is measured right before every region since the time of a run drifts over the whole table
+		double empty = Run(exit);
+		double run = Run(regions[variant]);
+
+		// A region is only compared against the empty region when both run in the same tier
+		bool tier = Translated(blob, regions[variant]);
+		double vm = tier == translated ? (run - empty) / COPIES : -1;
+
+		// Sealed code is not writable anymore so every variant gets a fresh buffer
+		ReleaseCode(code, VM_JIT_BUFFER_SIZE);
+		code = AllocateCode(VM_JIT_BUFFER_SIZE);
+		NativeFunction native = code ? Native(code, variant) : nullptr;
+
+		if (!native) {
+			std::printf("Failed to emit native code\n");
+			return;
+		}
+
+		double instruction = (Measure(RUNS, [&] { return native(memory); }) - baseline) / NATIVE_COPIES;
+
+		// Without an empty region of the same tier, or when the difference is lost in noise, only the run time is shown
+		char perInstruction[16] = "-";
+		char ratio[16] = "-";
+
+		if (vm >= 0) {
+			std::snprintf(perInstruction, sizeof(perInstruction), "%.2f", vm);
+
+			if (instruction > 0) {
+				std::snprintf(ratio, sizeof(ratio), "%.1fx", vm / instruction);
+			}
+		}
+
+		std::printf("%-28s %-12s %10.2f %10s %10.2f %8s\n", VariantName(variant).c_str(), TierName(tier), run, perInstruction, instruction, ratio);
+	}
+
+	// The entry stubs are generated per region by the protector, this is the part every activation shares
+	std::printf("VMDispatcher entry and exit: %.2f ns (%s)\n", activation, TierName(translated));
+
+#ifndef _WIN32
+	// Everything a call site pays on Linux hosts, VMEnter moves every register both ways
+	uint8_t* entry = AllocateCode(VM_JIT_BUFFER_SIZE);
+	NativeFunction enter = entry ? Enter(entry, blob, exit) : nullptr;
+
+	if (enter) {
+		std::printf("VMEnter entry and exit: %.2f ns\n", Measure(RUNS, [&] { return enter(memory); }) - baseline);
+		ReleaseCode(entry, VM_JIT_BUFFER_SIZE);
+	}
+#endif
+
+	ReleaseCode(code, VM_JIT_BUFFER_SIZE);
+}
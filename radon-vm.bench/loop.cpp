@@ -0,0 +1,28 @@
+#include <cstdio>
+#include "bench.hpp"
+
+namespace {
+	// Far more dispatches than any stack holds frames for, 8 MB overflowed after a fraction of them when every dispatch
+	// kept a frame
+	constexpr int ITERATIONS = 2000000;
+}
+
+// Runs one long guest loop in a single activation, it only finishes if dispatching takes the same stack however many
+// instructions run. Built without optimizations, a Debug build here or Debug|x64 on Windows, no compiler helps with it
+bool CheckLoop() {
+	Bytecode bytecode;
+	int start = bytecode.Entry(RegisterImmediate(MathOperation::Mov, 4, RCX, ITERATIONS));
+	int loop = bytecode.Entry(RegisterImmediate(MathOperation::Add, 8, RAX, 1));
+	bytecode.Entry(RegisterImmediate(MathOperation::Sub, 4, RCX, 1));
+	bytecode.Entry(Branch(VMOpcode::Jcc, VMCondition::NE, loop));
+	bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+	uint8_t* blob = bytecode.Finish();
+
+	// The first activation of a region is always interpreted, even with the JIT built in
+	VMState state{};
+	VMDispatcher(&state, blob, start);
+
+	bool finished = state.rax == ITERATIONS && state.rcx == 0;
+	std::printf("Loop check: %d iterations in one activation %s\n", ITERATIONS, finished ? "ok" : "gave the wrong result");
+	return finished;
+}
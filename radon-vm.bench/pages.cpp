@@ -0,0 +1,171 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "bench.hpp"
+#include "pages.hpp"
+
+#ifdef _WIN32
+// Page mode runs under the packer debugger on Windows, the stand-in is for hosts without it
+void BenchPages() {
+}
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+namespace {
+	constexpr int PAGES = 16;
+	constexpr int CALLS = 200000;
+
+	// Calls of every thread in the two thread run, both walk every page in the same order so they fault on the same ones
+	constexpr int SHARED_CALLS = 20000;
+
+	// Pages the stand-in keeps decrypted and executable, the default working set of the packer
+	constexpr size_t WORKING_SET = 4;
+
+	// Every page holds one function there, the straddling one starts right before the second page ends
+	constexpr uintptr_t FUNCTION_OFFSET = 0x100;
+	constexpr uintptr_t STRADDLING = 2 * CODE_PAGE_SIZE - 2;
+
+	// lea rax, [rdi + 1]; ret
+	const std::vector<uint8_t> Increment = { 0x48, 0x8D, 0x47, 0x01, 0xC3 };
+
+	// Rvas are relative to the mapping and its first page is left unused like the headers of a PE, so no page is 0
+	uint8_t* image;
+	PageSet* residentPages;
+	uint64_t faults;
+	// Faults on a page another thread already made resident
+	uint64_t retries;
+
+	// The debugger handles one event at a time, the handlers of faulting threads take turns on this the same way
+	std::atomic_flag handling;
+
+	using Function = uint64_t(*)(uint64_t);
+
+	// mprotect stands in for VirtualProtectEx, the pages are never writable and executable at once
+	void Protect(uintptr_t page, bool resident) {
+		uint8_t* address = image + page;
+		mprotect(address, CODE_PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+		if (resident) {
+			residentPages->decrypt(page, address);
+		}
+		else {
+			residentPages->encrypt(page, address);
+		}
+		mprotect(address, CODE_PAGE_SIZE, resident ? PROT_READ | PROT_EXEC : PROT_READ);
+	}
+
+	// SIGSEGV stands in for the access violation the debugger gets, bit 4 of the error code is set for instruction fetches
+	// A fault that is not a fetch from a page of the image falls back to the default action once it happens again
+	void OnFault(int, siginfo_t* info, void* context) {
+		const ucontext_t* ucontext = static_cast<const ucontext_t*>(context);
+		uintptr_t page = PageSet::pageOf(reinterpret_cast<uintptr_t>(info->si_addr) - reinterpret_cast<uintptr_t>(image));
+
+		if (!(ucontext->uc_mcontext.gregs[REG_ERR] & 0x10) || !residentPages->contains(page)) {
+			signal(SIGSEGV, SIG_DFL);
+			return;
+		}
+
+		while (handling.test_and_set(std::memory_order_acquire)) {
+		}
+
+		// Another thread faulted on the same page and had it decrypted first, the fetch only has to run again
+		if (residentPages->isResident(page)) {
+			retries++;
+			handling.clear(std::memory_order_release);
+			return;
+		}
+
+		faults++;
+		Protect(page, true);
+
+		uintptr_t evicted = residentPages->touch(page);
+
+		if (evicted) {
+			Protect(evicted, false);
+		}
+		handling.clear(std::memory_order_release);
+	}
+}
+
+// Calls into more and more pages of encrypted code round robin and reports what the page faults cost against the working set
+void BenchPages() {
+	const size_t size = (PAGES + 1) * CODE_PAGE_SIZE;
+	image = static_cast<uint8_t*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+	if (image == MAP_FAILED) {
+		return;
+	}
+
+	// Packed the way Packer.Execute does it, the instructions are encrypted into the runtime and the image only keeps 0xCC
+	Runtime runtime;
+	std::fill(image, image + size, static_cast<uint8_t>(0xCC));
+
+	for (int page = 1; page <= PAGES; page++) {
+		runtime.addInstruction(page * CODE_PAGE_SIZE + FUNCTION_OFFSET, RuntimeInstruction(Increment));
+	}
+	runtime.addInstruction(STRADDLING, RuntimeInstruction(Increment));
+
+	PageSet pageSet(runtime, WORKING_SET);
+	residentPages = &pageSet;
+
+	for (uintptr_t page : pageSet.getPages()) {
+		mprotect(image + page, CODE_PAGE_SIZE, PROT_READ);
+	}
+
+	struct sigaction action {};
+	struct sigaction previous {};
+	action.sa_sigaction = OnFault;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, &previous);
+
+	// The lea crosses into the next page, which has to fault in while the first one stays resident
+	uint64_t straddled = reinterpret_cast<Function>(image + STRADDLING)(41);
+	std::printf("Straddling call: %s (%llu faults)\n", straddled == 42 ? "ok" : "wrong result", static_cast<unsigned long long>(faults));
+
+	std::printf("%-8s %14s %14s (working set of %zu pages)\n", "Pages", "ns per call", "faults/call", WORKING_SET);
+
+	for (int spread = 1; spread <= PAGES; spread *= 2) {
+		uint64_t call = 0;
+		faults = 0;
+
+		double time = Measure(CALLS, [&] {
+			uintptr_t page = (call % spread + 1) * CODE_PAGE_SIZE;
+			return reinterpret_cast<Function>(image + page + FUNCTION_OFFSET)(call++);
+		});
+
+		std::printf("%-8d %14.1f %14.3f\n", spread, time, static_cast<double>(faults) / CALLS);
+	}
+
+	// Two threads walking every page at once keep faulting on pages the other one is decrypting or just made resident
+	faults = 0;
+	retries = 0;
+	std::atomic<int> wrong = 0;
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 2; i++) {
+		threads.emplace_back([&] {
+			for (uint64_t call = 0; call < SHARED_CALLS; call++) {
+				uintptr_t page = (call % PAGES + 1) * CODE_PAGE_SIZE;
+
+				if (reinterpret_cast<Function>(image + page + FUNCTION_OFFSET)(call) != call + 1) {
+					wrong++;
+				}
+			}
+		});
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+	std::printf("Two threads: %s (%llu faults, %llu on pages already resident)\n", wrong == 0 ? "ok" : "wrong result",
+		static_cast<unsigned long long>(faults), static_cast<unsigned long long>(retries));
+
+	sigaction(SIGSEGV, &previous, nullptr);
+	munmap(image, size);
+}
+#endif
@@ -0,0 +1,87 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "bench.hpp"
+
+namespace {
+	// Activations of every thread, the work per thread stays the same so the time stays flat while threads scale
+	constexpr int ACTIVATIONS = 20000;
+
+	// Loop iterations of every activation
+	constexpr int ITERATIONS = 64;
+
+	constexpr int MAX_THREADS = 64;
+
+	// Wall time of every thread running its activations once all of them are started
+	double Run(uint8_t* blob, int start, int threads) {
+		std::atomic<int> ready = 0;
+		std::atomic<bool> go = false;
+		std::vector<std::thread> workers;
+
+		for (int i = 0; i < threads; i++) {
+			workers.emplace_back([&] {
+				VMState state{};
+
+				// Decodes the region into the cache of this thread before the clock starts
+				VMDispatcher(&state, blob, start);
+
+				ready.fetch_add(1);
+
+				while (!go.load(std::memory_order_acquire)) {
+					std::this_thread::yield();
+				}
+
+				for (int activation = 0; activation < ACTIVATIONS; activation++) {
+					VMDispatcher(&state, blob, start);
+				}
+				sink = static_cast<uintptr_t>(state.rax);
+			});
+		}
+
+		while (ready.load() != threads) {
+			std::this_thread::yield();
+		}
+
+		auto begin = std::chrono::steady_clock::now();
+		go.store(true, std::memory_order_release);
+
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		auto end = std::chrono::steady_clock::now();
+		return std::chrono::duration<double>(end - begin).count();
+	}
+}
+
+// Runs the same region on 1 to 64 threads at once and reports the throughput against a single thread
+void BenchThreads() {
+	// Runs on fresh threads only, their caches have not seen the blob of the handler benchmark
+	Bytecode bytecode;
+	int start = bytecode.Entry(RegisterImmediate(MathOperation::Mov, 4, RCX, ITERATIONS));
+	int loop = bytecode.Entry(RegisterImmediate(MathOperation::Add, 8, RAX, 1));
+	bytecode.Entry(RegisterImmediate(MathOperation::Sub, 4, RCX, 1));
+	bytecode.Entry(Branch(VMOpcode::Jcc, VMCondition::NE, loop));
+	bytecode.Entry({ static_cast<uint8_t>(VMOpcode::Exit) });
+	uint8_t* blob = bytecode.Finish();
+
+	constexpr double instructions = static_cast<double>(ACTIVATIONS) * (ITERATIONS * 3 + 2);
+	unsigned cores = std::thread::hardware_concurrency();
+	double single = 0;
+
+	std::printf("%-8s %12s %10s %10s (%u hardware threads)\n", "Threads", "Minstr/s", "Speedup", "Scaling", cores);
+
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double throughput = instructions * threads / Run(blob, start, threads);
+
+		if (threads == 1) {
+			single = throughput;
+		}
+
+		// Scaling is measured against the threads that can actually run in parallel
+		int parallel = (cores && static_cast<unsigned>(threads) > cores) ? static_cast<int>(cores) : threads;
+		double speedup = throughput / single;
+		std::printf("%-8d %12.1f %9.2fx %9.0f%%\n", threads, throughput / 1e6, speedup, speedup / parallel * 100);
+	}
+}
@@ -2,8 +2,12 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #include <thread>
 
+// Appended to the path of the packed binary to name its trap profile
+constexpr const char* PROFILE_SUFFIX = ".traps";
+
 // Gets the image base for the specified process
 uintptr_t getImageBase(HANDLE hProcess) {
 	PROCESS_BASIC_INFORMATION processBasicInfo{ 0 };
@@ -141,6 +145,16 @@ bool execute(const char* path, const char* cmd, PROCESS_INFORMATION* pProcessInf
 	// Re-encrypt the payload
 	payload.crypt();
 
+	// In page mode the encrypted code must not be executable before the child runs any of it, nor writable at any time
+	if (runtime.getTrapMode() == TrapMode::Page) {
+		imageBase = reinterpret_cast<uintptr_t>(pImageBase);
+
+		for (uintptr_t page : pages.getPages()) {
+			DWORD oldProtect;
+			VirtualProtectEx(pProcessInfo->hProcess, pImageBase + page, CODE_PAGE_SIZE, PAGE_READONLY, &oldProtect);
+		}
+	}
+
 	// Write the new image base to Rdx + 16
 	WriteProcessMemory(pProcessInfo->hProcess, reinterpret_cast<void*>(context.Rdx + 16), &pImageBase, sizeof(pImageBase), nullptr);
 
@@ -151,7 +165,200 @@ bool execute(const char* path, const char* cmd, PROCESS_INFORMATION* pProcessInf
 	return true;
 }
 
+// Fills the block with breakpoints again so the next time it runs it traps
+void rearmBlock(HANDLE hProcess, uintptr_t start, uintptr_t end) {
+	std::vector<uint8_t> breakpoints(end - start, static_cast<uint8_t>(0xCC));
+	WriteProcessMemory(hProcess, reinterpret_cast<void*>(imageBase + start), &breakpoints[0], breakpoints.size(), nullptr);
+	FlushInstructionCache(hProcess, reinterpret_cast<void*>(imageBase + start), breakpoints.size());
+}
+
+// Hot blocks are left decrypted for the rest of the run and never take up a slot of a working set
+bool isPromoted(uintptr_t start) {
+	auto it = traps.find(start);
+	return runtime.getHotThreshold() && it != traps.end() && it->second >= runtime.getHotThreshold();
+}
+
+// Decrypts the block into the child, the plain copy is wiped right after so only the child keeps it
+bool writeBlock(HANDLE hProcess, uintptr_t start, uintptr_t end) {
+	std::vector<uint8_t> blockBytes = runtime.decryptBlock(start, end);
+
+	bool written = WriteProcessMemory(hProcess, reinterpret_cast<void*>(imageBase + start), &blockBytes[0], blockBytes.size(), nullptr);
+
+	SecureZeroMemory(&blockBytes[0], blockBytes.size());
+
+	if (written) {
+		FlushInstructionCache(hProcess, reinterpret_cast<void*>(imageBase + start), blockBytes.size());
+	}
+	return written;
+}
+
+// Drops the hold of one thread on the block and re-arms it once no thread holds it anymore
+void releaseBlock(HANDLE hProcess, uintptr_t start) {
+	auto it = residents.find(start);
+
+	if (it == residents.end() || --it->second != 0) {
+		return;
+	}
+	residents.erase(it);
+
+	uintptr_t blockStart, blockEnd;
+
+	if (!isPromoted(start) && runtime.getBlock(start, blockStart, blockEnd)) {
+		rearmBlock(hProcess, blockStart, blockEnd);
+	}
+}
+
+// Re-arms what only the exiting thread still held
+void releaseThread(HANDLE hProcess, DWORD threadId) {
+	auto it = workingSets.find(threadId);
+
+	if (it == workingSets.end()) {
+		return;
+	}
+
+	for (uintptr_t start : it->second.getBlocks()) {
+		releaseBlock(hProcess, start);
+	}
+	workingSets.erase(it);
+	predictions.erase(threadId);
+}
+
+// Makes the decrypted block the most recent one of the thread and releases the one that falls out of the set
+void holdBlock(HANDLE hProcess, WorkingSet& workingSet, uintptr_t start) {
+	if (isPromoted(start)) {
+		return;
+	}
+
+	if (!workingSet.contains(start)) {
+		residents[start]++;
+	}
+
+	uintptr_t evicted = workingSet.touch(start, runtime.getWorkingSet());
+
+	if (evicted) {
+		releaseBlock(hProcess, evicted);
+	}
+}
+
+// Counts whether the trap in the block was foreseen by what the thread decrypted ahead on its previous trap
+void recordSpeculation(DWORD threadId, uintptr_t start) {
+	auto it = predictions.find(threadId);
+
+	if (it == predictions.end() || it->second.empty()) {
+		return;
+	}
+
+	bool hit = std::any_of(it->second.begin(), it->second.end(), [start](uintptr_t predicted) {
+		const std::vector<uintptr_t>& successors = runtime.getSuccessors(predicted);
+		return std::find(successors.begin(), successors.end(), start) != successors.end();
+	});
+
+	if (hit) {
+		speculationHits++;
+	}
+	else {
+		speculationMisses++;
+	}
+	it->second.clear();
+}
+
+// Decrypts the successors of the block ahead so the thread runs on into them without trapping again
+// One slot of the working set is kept for the block itself, so nothing is decrypted ahead with a working set of one
+void decryptSuccessors(HANDLE hProcess, DWORD threadId, WorkingSet& workingSet, uintptr_t start) {
+	std::vector<uintptr_t>& predicted = predictions[threadId];
+
+	for (uintptr_t successor : runtime.getSuccessors(start)) {
+		if (predicted.size() + 1 >= runtime.getWorkingSet()) {
+			break;
+		}
+
+		uintptr_t successorStart, successorEnd;
+
+		if (successor == start || !runtime.getBlock(successor, successorStart, successorEnd)) {
+			continue;
+		}
+
+		if (!residents.contains(successorStart) && !isPromoted(successorStart) && !writeBlock(hProcess, successorStart, successorEnd)) {
+			continue;
+		}
+
+		holdBlock(hProcess, workingSet, successorStart);
+		predicted.push_back(successorStart);
+	}
+}
+
+// Decrypts the page in the child and makes it executable, or fills it with 0xCC again and takes execution away
+// The page is only writable while it is written, a resident page is PAGE_EXECUTE_READ and any other one PAGE_READONLY
+bool protectPage(HANDLE hProcess, uintptr_t page, bool resident) {
+	void* address = reinterpret_cast<void*>(imageBase + page);
+	uint8_t pageBytes[CODE_PAGE_SIZE];
+	DWORD oldProtect;
+
+	if (!ReadProcessMemory(hProcess, address, pageBytes, CODE_PAGE_SIZE, nullptr)) {
+		return false;
+	}
+
+	if (resident) {
+		pages.decrypt(page, pageBytes);
+	}
+	else {
+		pages.encrypt(page, pageBytes);
+	}
+
+	bool written = VirtualProtectEx(hProcess, address, CODE_PAGE_SIZE, PAGE_READWRITE, &oldProtect) &&
+		WriteProcessMemory(hProcess, address, pageBytes, CODE_PAGE_SIZE, nullptr);
+
+	// Wipe the plain copy, only the child keeps the decrypted page
+	SecureZeroMemory(pageBytes, CODE_PAGE_SIZE);
+
+	if (!VirtualProtectEx(hProcess, address, CODE_PAGE_SIZE, resident ? PAGE_EXECUTE_READ : PAGE_READONLY, &oldProtect) || !written) {
+		return false;
+	}
+
+	FlushInstructionCache(hProcess, address, CODE_PAGE_SIZE);
+	return true;
+}
+
+// Page mode counterpart of the breakpoint handler, the child faults when it executes a page that is not resident
+// The page is decrypted and made executable, the least recently faulted page is protected again once too many are resident
+// The faulting instruction simply runs again, so the context of the thread is left alone
+// Returns false for any fault the packer does not own, the child has to see those itself
+bool handlePageFault(DEBUG_EVENT debugEvent, HANDLE hProcess) {
+	const EXCEPTION_RECORD& record = debugEvent.u.Exception.ExceptionRecord;
+
+	if (record.ExceptionInformation[0] != EXCEPTION_EXECUTE_FAULT) {
+		return false;
+	}
+
+	uintptr_t page = PageSet::pageOf(record.ExceptionInformation[1] - imageBase);
+
+	if (!pages.contains(page)) {
+		return false;
+	}
+
+	// Another thread may have faulted on the same page and had it decrypted first, then this one only has to run it again
+	if (pages.isResident(page)) {
+		return true;
+	}
+
+	if (!protectPage(hProcess, page, true)) {
+		return false;
+	}
+
+	uintptr_t evicted = pages.touch(page);
+
+	if (evicted) {
+		protectPage(hProcess, evicted, false);
+	}
+	return true;
+}
+
 // The main handler that replaces the int 3h instructions with the real ones
+// The whole basic block of the trapping instruction is decrypted and joins the working set of the thread, the block
+// the thread trapped in least recently leaves it once the set is full and is encrypted again when no other thread holds it
+// The blocks it can continue at are decrypted ahead and join the set too
+// A block that trapped as often as the hot threshold is promoted, it is never encrypted again
+// All threads of the child are stopped while a debug event is handled, so none of them sees a block half written
 void handleDebugEvent(DEBUG_EVENT debugEvent, HANDLE hProcess) {
 	HANDLE hThread = OpenThread(THREAD_ALL_ACCESS, false, debugEvent.dwThreadId);
 
@@ -170,28 +377,15 @@ void handleDebugEvent(DEBUG_EVENT debugEvent, HANDLE hProcess) {
 		return;
 	}
 
-	uintptr_t imageBase = getImageBase(hProcess);
-	uintptr_t oldRVA = runtime.getOldRVA();
-
-	if (oldRVA != 0) {
-		if (runtime.hasInstruction(oldRVA)) {
-			uintptr_t oldVA = oldRVA - imageBase;
-
-			uint8_t breakpoint = static_cast<uint8_t>(0xCC);
-
-			RuntimeInstruction oldRuntimeInstr = runtime.getInstruction(oldRVA);
-			std::vector<uint8_t> oldInstrBytes = oldRuntimeInstr.getBytes();
-
-			for (size_t i = 0; i < oldInstrBytes.size(); i++) {
-				WriteProcessMemory(hProcess, reinterpret_cast<void*>(oldVA + i), &breakpoint, sizeof(breakpoint), nullptr);
-			}
-		}
+	if (!imageBase) {
+		imageBase = getImageBase(hProcess);
 	}
 
 	uintptr_t va = ctx.Rip - 1;
 	uintptr_t rva = va - imageBase;
+	uintptr_t start, end;
 
-	if (!runtime.hasInstruction(rva)) {
+	if (!runtime.getBlock(rva, start, end)) {
 		ctx.Rip += 1;
 		SetThreadContext(hThread, &ctx);
 		ResumeThread(hThread);
@@ -199,35 +393,57 @@ void handleDebugEvent(DEBUG_EVENT debugEvent, HANDLE hProcess) {
 		return;
 	}
 
-	RuntimeInstruction runtimeInstr = runtime.getInstruction(rva);
-
-	// Decrypt the instruction
-	runtimeInstr.crypt();
-
-	std::vector<uint8_t> instrBytes = runtimeInstr.getBytes();
-
 	ctx.Rip -= 1;
 
-	if (!WriteProcessMemory(hProcess, reinterpret_cast<void*>(va), &instrBytes[0], instrBytes.size(), nullptr)) {
-		// Re-encrypt the instruction
-		runtimeInstr.crypt();
-
+	// Another thread may have decrypted the block after this one trapped in it, then it only has to run it again
+	if (!residents.contains(start) && !isPromoted(start) && !writeBlock(hProcess, start, end)) {
 		SetThreadContext(hThread, &ctx);
 		ResumeThread(hThread);
 		CloseHandle(hThread);
 		return;
 	}
 
-	// Re-encrypt the instruction
-	runtimeInstr.crypt();
+	traps[start]++;
+	recordSpeculation(debugEvent.dwThreadId, start);
 
-	runtime.setOldRVA(rva);
+	// Held before the successors so they cannot push it out, and again after so it ends up the most recent one
+	WorkingSet& workingSet = workingSets[debugEvent.dwThreadId];
+	holdBlock(hProcess, workingSet, start);
+	decryptSuccessors(hProcess, debugEvent.dwThreadId, workingSet, start);
+	holdBlock(hProcess, workingSet, start);
 
 	SetThreadContext(hThread, &ctx);
 	ResumeThread(hThread);
 	CloseHandle(hThread);
 }
 
+// Writes the traps of every block next to the packed binary, the protector reads it back to leave hot blocks unencrypted
+// Every line is the rva of a block in hex followed by how often it trapped
+// Only written when the binary was packed to record it, and never in page mode where blocks do not trap
+void writeProfile() {
+	if (!runtime.shouldRecordProfile() || runtime.getTrapMode() != TrapMode::Block) {
+		return;
+	}
+
+	char path[MAX_PATH];
+
+	if (!GetModuleFileNameA(nullptr, path, MAX_PATH)) {
+		return;
+	}
+
+	std::ofstream profile(std::string(path) + PROFILE_SUFFIX);
+
+	if (!profile) {
+		return;
+	}
+
+	profile << "# rva traps" << std::endl;
+
+	for (const auto& [start, count] : traps) {
+		profile << std::hex << std::uppercase << start << std::dec << " " << count << std::endl;
+	}
+}
+
 // Catches the debug events
 void handler(HANDLE hProcess, HANDLE hThread) {
 	DEBUG_EVENT debugEvent{ 0 };
@@ -237,15 +453,33 @@ void handler(HANDLE hProcess, HANDLE hThread) {
 	while (running) {
 		WaitForDebugEvent(&debugEvent, INFINITE);
 
+		DWORD continueStatus = DBG_CONTINUE;
+
 		switch (debugEvent.dwDebugEventCode) {
 		case EXCEPTION_DEBUG_EVENT:
-			handleDebugEvent(debugEvent, hProcess);
+			// Breakpoints such as the one of the loader still go through the breakpoint handler in page mode
+			if (runtime.getTrapMode() == TrapMode::Page && debugEvent.u.Exception.ExceptionRecord.ExceptionCode == EXCEPTION_ACCESS_VIOLATION) {
+				// Faults of the child itself go on to its own handlers, continuing them would only run into them again
+				if (!handlePageFault(debugEvent, hProcess)) {
+					continueStatus = DBG_EXCEPTION_NOT_HANDLED;
+				}
+			}
+			else {
+				handleDebugEvent(debugEvent, hProcess);
+			}
+			break;
+		case EXIT_THREAD_DEBUG_EVENT:
+			releaseThread(hProcess, debugEvent.dwThreadId);
 			break;
 		case EXIT_PROCESS_DEBUG_EVENT:
+#if PACKER_STATS
+			std::cout << "Speculation: " << speculationHits << " hits, " << speculationMisses << " misses" << std::endl;
+#endif
+			writeProfile();
 			running = false;
 			break;
 		}
-		ContinueDebugEvent(debugEvent.dwProcessId, debugEvent.dwThreadId, DBG_CONTINUE);
+		ContinueDebugEvent(debugEvent.dwProcessId, debugEvent.dwThreadId, continueStatus);
 	}
 
 	ContinueDebugEvent(debugEvent.dwProcessId, debugEvent.dwThreadId, DBG_CONTINUE);
@@ -267,6 +501,10 @@ int main(int argc, char* argv[]) {
 	runtime.deserialize(radon0);
 	payload.deserialize(radon1);
 
+	if (runtime.getTrapMode() == TrapMode::Page) {
+		pages = PageSet(runtime, runtime.getWorkingSet());
+	}
+
 	PROCESS_INFORMATION processInfo{ 0 };
 
 	std::string cmd;
@@ -3,6 +3,12 @@
 #include <TlHelp32.h>
 #include <Psapi.h>
 #include "runtime.hpp"
+#include "pages.hpp"
+
+// Prints the speculation counters when the child exits, off by default since the child shares the console of the packer
+#ifndef PACKER_STATS
+#define PACKER_STATS 0
+#endif
 
 typedef enum _PROCESSINFOCLASS {
 	ProcessBasicInformation
@@ -35,4 +41,24 @@ Runtime runtime;
 Payload payload;
 std::vector<uint8_t> radon0, radon1;
 
+// Image base of the child, looked up on its first debug event
+uintptr_t imageBase = 0;
+
+// Decrypted blocks of every thread and how many threads hold each block, a block is encrypted again once none does
+std::map<DWORD, WorkingSet> workingSets;
+std::map<uintptr_t, size_t> residents;
+
+// Blocks every thread had decrypted ahead on its last trap
+std::map<DWORD, std::vector<uintptr_t>> predictions;
+
+// A trap is a hit if it lands in a successor of a block decrypted ahead, so execution went through that block, a miss otherwise
+uint64_t speculationHits = 0;
+uint64_t speculationMisses = 0;
+
+// Resident pages of the child in page mode, a page takes every thread out of the encrypted state at once so the set is shared
+PageSet pages;
+
+// Traps of every block, written to the trap profile when the child exits
+std::map<uintptr_t, uint64_t> traps;
+
 bool relocated = false;
\ No newline at end of file
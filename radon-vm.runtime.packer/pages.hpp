@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <set>
+#include <vector>
+#include "runtime.hpp"
+
+// Granularity the code of the child is protected at
+constexpr uintptr_t CODE_PAGE_SIZE = 0x1000;
+
+// Pages of the packed code in page mode, a resident page is decrypted and executable and any other one is filled with
+// 0xCC and not executable, so the first instruction fetched from it faults
+// Only the bookkeeping lives here, the debugger changes the protection of the child with VirtualProtectEx while the
+// Linux stand-in in the bench uses mprotect on its own memory
+class PageSet {
+public:
+	// Rva of the page holding the rva
+	static inline uintptr_t pageOf(uintptr_t rva) {
+		return rva & ~(CODE_PAGE_SIZE - 1);
+	}
+
+	inline bool contains(uintptr_t page) const {
+		return this->pages.contains(page);
+	}
+
+	inline bool isResident(uintptr_t page) const {
+		return this->resident.contains(page);
+	}
+
+	// Makes the page the most recent resident one and returns the least recent one if there are too many now, 0 otherwise
+	inline uintptr_t touch(uintptr_t page) {
+		return this->resident.touch(page, this->limit);
+	}
+
+	// Writes the decrypted instructions of the page over its bytes
+	inline void decrypt(uintptr_t page, uint8_t* bytes) const {
+		this->runtime->decryptRange(page, page + CODE_PAGE_SIZE, bytes);
+	}
+
+	// Fills the bytes of every instruction of the page with 0xCC again, the bytes around them are left as they are
+	void encrypt(uintptr_t page, uint8_t* bytes) const {
+		const std::map<uintptr_t, RuntimeInstruction>& instrs = this->runtime->getInstructions();
+		auto it = instrs.lower_bound(page);
+
+		if (it != instrs.begin()) {
+			it--;
+		}
+
+		for (; it != instrs.end() && it->first < page + CODE_PAGE_SIZE; it++) {
+			const uintptr_t start = std::max(it->first, page);
+			const uintptr_t end = std::min(it->first + it->second.getBytes().size(), page + CODE_PAGE_SIZE);
+
+			for (uintptr_t rva = start; rva < end; rva++) {
+				bytes[rva - page] = 0xCC;
+			}
+		}
+	}
+
+	inline const std::set<uintptr_t>& getPages() const {
+		return this->pages;
+	}
+
+	// An instruction can cross into the next page, so at least two pages are resident or it would never finish faulting
+	PageSet(const Runtime& runtime, size_t limit) {
+		this->runtime = &runtime;
+		this->limit = std::max<size_t>(limit, 2);
+
+		for (const auto& [rva, instr] : runtime.getInstructions()) {
+			for (uintptr_t page = pageOf(rva); page < rva + instr.getBytes().size(); page += CODE_PAGE_SIZE) {
+				this->pages.insert(page);
+			}
+		}
+	}
+
+	PageSet() {}
+private:
+	const Runtime* runtime = nullptr;
+	// Every page holding encrypted instruction bytes
+	std::set<uintptr_t> pages;
+	WorkingSet resident;
+	size_t limit = 2;
+};
@@ -1,12 +1,20 @@
+#pragma once
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 #include <random>
 #include <map>
 #include <iostream>
-#include <Windows.h>
 
 constexpr size_t KEY_SIZE = 32;
 
+// How the child traps into encrypted code, on the 0xCC filling every instruction or on executing a page that is not executable
+enum class TrapMode : uint64_t {
+	Block,
+	Page
+};
+
 class RuntimeInstruction {
 public:
 	inline void crypt() {
@@ -47,6 +55,28 @@ private:
 	std::vector<uint8_t> key;
 };
 
+// A basic block and the blocks it can continue at, the fall-through first
+class RuntimeBlock {
+public:
+	inline uintptr_t getEnd() const {
+		return this->end;
+	}
+
+	inline const std::vector<uintptr_t>& getSuccessors() const {
+		return this->successors;
+	}
+
+	RuntimeBlock(uintptr_t end, std::vector<uintptr_t> successors) {
+		this->end = end;
+		this->successors = successors;
+	}
+
+	RuntimeBlock() {}
+private:
+	uintptr_t end = 0;
+	std::vector<uintptr_t> successors;
+};
+
 class Runtime {
 public:
 	std::vector<uint8_t> serialize() const {
@@ -69,9 +99,24 @@ public:
 			serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&keySize), reinterpret_cast<const uint8_t*>(&keySize) + sizeof(keySize));
 			serialized.insert(serialized.end(), keyBytes.data(), keyBytes.data() + keyBytes.size());
 		}
-		const uint32_t oldRVASize = sizeof(this->oldRVA);
-		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&oldRVASize), reinterpret_cast<const uint8_t*>(&oldRVASize) + sizeof(oldRVASize));
-		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&this->oldRVA), reinterpret_cast<const uint8_t*>(&this->oldRVA) + oldRVASize);
+		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&this->workingSet), reinterpret_cast<const uint8_t*>(&this->workingSet) + sizeof(this->workingSet));
+		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&this->hotThreshold), reinterpret_cast<const uint8_t*>(&this->hotThreshold) + sizeof(this->hotThreshold));
+		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&this->recordProfile), reinterpret_cast<const uint8_t*>(&this->recordProfile) + sizeof(this->recordProfile));
+		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&this->trapMode), reinterpret_cast<const uint8_t*>(&this->trapMode) + sizeof(this->trapMode));
+
+		const size_t blockCount = this->blocks.size();
+		serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&blockCount), reinterpret_cast<const uint8_t*>(&blockCount) + sizeof(blockCount));
+
+		for (const auto& [start, block] : this->blocks) {
+			const uintptr_t end = block.getEnd();
+			serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&start), reinterpret_cast<const uint8_t*>(&start) + sizeof(start));
+			serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&end), reinterpret_cast<const uint8_t*>(&end) + sizeof(end));
+
+			const std::vector<uintptr_t>& successors = block.getSuccessors();
+			const size_t successorCount = successors.size();
+			serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(&successorCount), reinterpret_cast<const uint8_t*>(&successorCount) + sizeof(successorCount));
+			serialized.insert(serialized.end(), reinterpret_cast<const uint8_t*>(successors.data()), reinterpret_cast<const uint8_t*>(successors.data() + successorCount));
+		}
 
 		return serialized;
 	}
@@ -105,17 +150,107 @@ public:
 			this->runtimeInstrs.emplace(rva, runtimeInstr);
 		}
 
-		uint32_t oldRVASize;
-		std::memcpy(&oldRVASize, &serialized[offset], sizeof(oldRVASize));
-		offset += sizeof(oldRVASize);
-		std::memcpy(&this->oldRVA, &serialized[offset], oldRVASize);
-		offset += oldRVASize;
+		std::memcpy(&this->workingSet, &serialized[offset], sizeof(this->workingSet));
+		offset += sizeof(this->workingSet);
+
+		std::memcpy(&this->hotThreshold, &serialized[offset], sizeof(this->hotThreshold));
+		offset += sizeof(this->hotThreshold);
+
+		std::memcpy(&this->recordProfile, &serialized[offset], sizeof(this->recordProfile));
+		offset += sizeof(this->recordProfile);
+
+		std::memcpy(&this->trapMode, &serialized[offset], sizeof(this->trapMode));
+		offset += sizeof(this->trapMode);
+
+		size_t blockCount;
+		std::memcpy(&blockCount, &serialized[offset], sizeof(blockCount));
+		offset += sizeof(blockCount);
+
+		for (size_t i = 0; i < blockCount; i++) {
+			uintptr_t start, end;
+			std::memcpy(&start, &serialized[offset], sizeof(start));
+			offset += sizeof(start);
+			std::memcpy(&end, &serialized[offset], sizeof(end));
+			offset += sizeof(end);
+
+			size_t successorCount;
+			std::memcpy(&successorCount, &serialized[offset], sizeof(successorCount));
+			offset += sizeof(successorCount);
+
+			std::vector<uintptr_t> successors(successorCount);
+
+			for (size_t j = 0; j < successorCount; j++) {
+				std::memcpy(&successors[j], &serialized[offset], sizeof(successors[j]));
+				offset += sizeof(successors[j]);
+			}
+
+			this->blocks.emplace(start, RuntimeBlock(end, successors));
+		}
 	}
 
 	inline void addInstruction(uintptr_t rva, RuntimeInstruction runtimeInstr) {
 		this->runtimeInstrs.emplace(rva, runtimeInstr);
 	}
 
+	inline void addBlock(uintptr_t start, uintptr_t end, std::vector<uintptr_t> successors) {
+		this->blocks.emplace(start, RuntimeBlock(end, successors));
+	}
+
+	// Finds the block containing the rva, blocks never overlap so it is the last one starting at or before it
+	bool getBlock(uintptr_t rva, uintptr_t& start, uintptr_t& end) const {
+		auto it = this->blocks.upper_bound(rva);
+
+		if (it == this->blocks.begin()) {
+			return false;
+		}
+		it--;
+
+		if (rva >= it->second.getEnd()) {
+			return false;
+		}
+
+		start = it->first;
+		end = it->second.getEnd();
+		return true;
+	}
+
+	// The blocks the block starting at the rva can continue at
+	inline const std::vector<uintptr_t>& getSuccessors(uintptr_t start) const {
+		return this->blocks.at(start).getSuccessors();
+	}
+
+	// Decrypts every instruction of the block into one buffer so it can be written back at once
+	std::vector<uint8_t> decryptBlock(uintptr_t start, uintptr_t end) const {
+		std::vector<uint8_t> bytes(end - start, static_cast<uint8_t>(0xCC));
+		this->decryptRange(start, end, &bytes[0]);
+		return bytes;
+	}
+
+	// Writes the decrypted bytes of every instruction overlapping the range over the buffer holding it, bytes of
+	// instructions crossing either end of the range are cut off and everything in between is left as it is
+	void decryptRange(uintptr_t start, uintptr_t end, uint8_t* bytes) const {
+		auto it = this->runtimeInstrs.lower_bound(start);
+
+		if (it != this->runtimeInstrs.begin()) {
+			it--;
+		}
+
+		for (; it != this->runtimeInstrs.end() && it->first < end; it++) {
+			RuntimeInstruction runtimeInstr = it->second;
+			runtimeInstr.crypt();
+
+			const std::vector<uint8_t>& instrBytes = runtimeInstr.getBytes();
+
+			for (size_t i = 0; i < instrBytes.size(); i++) {
+				const uintptr_t rva = it->first + i;
+
+				if (rva >= start && rva < end) {
+					bytes[rva - start] = instrBytes[i];
+				}
+			}
+		}
+	}
+
 	inline bool hasInstruction(uintptr_t rva) {
 		return this->runtimeInstrs.contains(rva);
 	}
@@ -124,23 +259,72 @@ public:
 		return this->runtimeInstrs[rva];
 	}
 
-	uintptr_t getOldRVA() {
-		if (this->oldRVA != 0) {
-			const uintptr_t oldRVA = this->oldRVA;
-			this->oldRVA = 0;
-			return oldRVA;
-		}
-		return 0;
+	inline size_t getWorkingSet() const {
+		return this->workingSet;
+	}
+
+	inline uint64_t getHotThreshold() const {
+		return this->hotThreshold;
+	}
+
+	inline bool shouldRecordProfile() const {
+		return this->recordProfile != 0;
 	}
 
-	inline void setOldRVA(uintptr_t rva) {
-		this->oldRVA = rva;
+	inline TrapMode getTrapMode() const {
+		return this->trapMode;
+	}
+
+	inline const std::map<uintptr_t, RuntimeInstruction>& getInstructions() const {
+		return this->runtimeInstrs;
 	}
 
 	Runtime() {}
 private:
 	std::map<uintptr_t, RuntimeInstruction> runtimeInstrs;
-	uintptr_t oldRVA = 0;
+	// Every basic block by its start, recorded at pack time
+	std::map<uintptr_t, RuntimeBlock> blocks;
+	// Blocks every thread keeps decrypted at once
+	size_t workingSet = 1;
+	// Traps after which a block stays decrypted for the rest of the run, 0 never promotes a block
+	uint64_t hotThreshold = 0;
+	// Whether the trap profile is written on exit, it tells where the hot code is so only profiling builds opt in
+	uint64_t recordProfile = 0;
+	TrapMode trapMode = TrapMode::Block;
+};
+
+// Blocks one thread has decrypted, the most recently trapped one first
+class WorkingSet {
+public:
+	inline bool contains(uintptr_t start) const {
+		return std::find(this->blocks.begin(), this->blocks.end(), start) != this->blocks.end();
+	}
+
+	// Makes the block the most recent one and returns the least recent one if the set grew past the limit, 0 otherwise
+	uintptr_t touch(uintptr_t start, size_t limit) {
+		auto it = std::find(this->blocks.begin(), this->blocks.end(), start);
+
+		if (it != this->blocks.end()) {
+			this->blocks.erase(it);
+		}
+		this->blocks.insert(this->blocks.begin(), start);
+
+		if (this->blocks.size() <= limit) {
+			return 0;
+		}
+
+		const uintptr_t evicted = this->blocks.back();
+		this->blocks.pop_back();
+		return evicted;
+	}
+
+	inline const std::vector<uintptr_t>& getBlocks() const {
+		return this->blocks;
+	}
+
+	WorkingSet() {}
+private:
+	std::vector<uintptr_t> blocks;
 };
 
 class Payload {
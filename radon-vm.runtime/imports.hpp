@@ -0,0 +1,90 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include "lazy_importer.hpp"
+
+// Functions the runtime calls, resolved once instead of walking the loader structures on every call
+enum class VMImport {
+	Calloc,
+	Free,
+	GetModuleHandleA,
+	VirtualAlloc,
+	VirtualProtect,
+	VirtualFree,
+	GetCurrentThreadId,
+	CreateFileA,
+	CreateFileMappingA,
+	MapViewOfFile,
+	FlsAlloc,
+	FlsGetValue,
+	FlsSetValue,
+	Count
+};
+
+// Slots hold the function addresses xored with a key picked when they are resolved
+struct VMImports {
+	uint64_t key;
+	uint64_t slots[static_cast<int>(VMImport::Count)];
+};
+
+inline VMImports imports;
+
+#define VM_IMPORT(slot, function) reinterpret_cast<decltype(&function)>(imports.slots[static_cast<int>(VMImport::slot)] ^ imports.key)
+
+// Called once while the runtime initializes, before any handler calls through a slot
+// Returns false when a function is not found, its module may not be loaded in this process and its slot must not be used
+inline bool ResolveImports() {
+	uint64_t key = __rdtsc() | 1;
+	imports.slots[static_cast<int>(VMImport::Calloc)] = reinterpret_cast<uint64_t>(LI_FN(calloc).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::Free)] = reinterpret_cast<uint64_t>(LI_FN(free).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::GetModuleHandleA)] = reinterpret_cast<uint64_t>(LI_FN(GetModuleHandleA).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::VirtualAlloc)] = reinterpret_cast<uint64_t>(LI_FN(VirtualAlloc).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::VirtualProtect)] = reinterpret_cast<uint64_t>(LI_FN(VirtualProtect).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::VirtualFree)] = reinterpret_cast<uint64_t>(LI_FN(VirtualFree).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::GetCurrentThreadId)] = reinterpret_cast<uint64_t>(LI_FN(GetCurrentThreadId).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::CreateFileA)] = reinterpret_cast<uint64_t>(LI_FN(CreateFileA).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::CreateFileMappingA)] = reinterpret_cast<uint64_t>(LI_FN(CreateFileMappingA).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::MapViewOfFile)] = reinterpret_cast<uint64_t>(LI_FN(MapViewOfFile).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::FlsAlloc)] = reinterpret_cast<uint64_t>(LI_FN(FlsAlloc).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::FlsGetValue)] = reinterpret_cast<uint64_t>(LI_FN(FlsGetValue).get()) ^ key;
+	imports.slots[static_cast<int>(VMImport::FlsSetValue)] = reinterpret_cast<uint64_t>(LI_FN(FlsSetValue).get()) ^ key;
+	imports.key = key;
+
+	for (uint64_t slot : imports.slots) {
+		if ((slot ^ key) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Placed by the linker at rva 0 and reached with a rip relative lea, InjectHelper leaves rva 0 as it is so the injected
+// copy gets the base of the protected image, which is not the host process for a protected DLL
+extern "C" IMAGE_DOS_HEADER __ImageBase;
+
+inline uintptr_t GetImageBase() {
+	return reinterpret_cast<uintptr_t>(&__ImageBase);
+}
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+// Other platforms only run the runtime for testing, profiling and benchmarking, imports are called directly there
+#define VM_IMPORT(slot, function) (&function)
+
+inline bool ResolveImports() {
+	return true;
+}
+
+extern "C" char __executable_start;
+
+inline uintptr_t GetImageBase() {
+	return reinterpret_cast<uintptr_t>(&__executable_start);
+}
+#endif
@@ -0,0 +1,525 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "vm.hpp"
+
+#ifdef _WIN32
+#include "imports.hpp"
+#else
+#include <sys/mman.h>
+#include <x86intrin.h>
+#endif
+
+// Executions of a region before it is translated to native code, 0 leaves everything to the interpreter
+#ifndef VM_JIT_THRESHOLD
+#define VM_JIT_THRESHOLD 0
+#endif
+
+// Number of regions tracked, a region keeps its slot once it claimed it
+#ifndef VM_JIT_REGIONS
+#define VM_JIT_REGIONS 64
+#endif
+
+// Limits of a single translation, larger regions stay in the interpreter
+#ifndef VM_JIT_MAX_INSTRUCTIONS
+#define VM_JIT_MAX_INSTRUCTIONS 128
+#endif
+
+#ifndef VM_JIT_BUFFER_SIZE
+#define VM_JIT_BUFFER_SIZE 0x4000
+#endif
+
+enum class VMJitPolicy {
+	// Native code stays until the process exits
+	Keep,
+	// Native code is released after VM_JIT_LIFETIME runs and the region goes back to the interpreter
+	Discard,
+	// Native code is translated again with a new layout every VM_JIT_LIFETIME runs
+	Rerandomize
+};
+
+#ifndef VM_JIT_POLICY
+#define VM_JIT_POLICY VMJitPolicy::Keep
+#endif
+
+#ifndef VM_JIT_LIFETIME
+#define VM_JIT_LIFETIME 0x10000
+#endif
+
+enum class VMJitState : uint32_t {
+	Counting,
+	Compiling,
+	Compiled,
+	Rejected
+};
+
+typedef void(*VMJitCode)(VMState* state);
+typedef const VMInstruction* (*VMFetch)(VMState* state, uint32_t index);
+
+struct VMJitRegion {
+	// Address of the first entry of the region owning the slot, 0 while it is free
+	// The address and not the index, every blob starts its regions at the same few indices
+	std::atomic<uintptr_t> tag;
+	std::atomic<VMJitState> state;
+	std::atomic<uint32_t> count;
+	// Threads currently running the native code, it is only released once this drops to 0
+	std::atomic<uint32_t> active;
+	std::atomic<uint32_t> runs;
+	VMJitCode code;
+};
+
+inline VMJitRegion jitRegions[VM_JIT_REGIONS];
+
+// Slot of the region starting at the bytecode index, the tag tells whether the region actually owns it
+inline VMJitRegion& GetRegion(uint8_t* bytecode, uint32_t index) {
+	return jitRegions[(reinterpret_cast<uintptr_t>(bytecode) + index) % VM_JIT_REGIONS];
+}
+
+#ifdef _WIN32
+inline uint8_t* AllocateCode(size_t size) {
+	return static_cast<uint8_t*>(VM_IMPORT(VirtualAlloc, VirtualAlloc)(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+}
+
+inline bool SealCode(uint8_t* code, size_t size) {
+	DWORD old;
+	return VM_IMPORT(VirtualProtect, VirtualProtect)(code, size, PAGE_EXECUTE_READ, &old);
+}
+
+inline void ReleaseCode(uint8_t* code, size_t size) {
+	VM_IMPORT(VirtualFree, VirtualFree)(code, 0, MEM_RELEASE);
+}
+#else
+inline uint8_t* AllocateCode(size_t size) {
+	void* code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return code == MAP_FAILED ? nullptr : static_cast<uint8_t*>(code);
+}
+
+inline bool SealCode(uint8_t* code, size_t size) {
+	return mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+}
+
+inline void ReleaseCode(uint8_t* code, size_t size) {
+	munmap(code, size);
+}
+#endif
+
+// Register numbers of the native code, the state pointer is kept in r11 and the rest is scratch
+constexpr uint8_t JIT_RAX = 0;
+constexpr uint8_t JIT_RCX = 1;
+constexpr uint8_t JIT_R9 = 9;
+constexpr uint8_t JIT_R10 = 10;
+
+// Status flags the native code computes, the other rflags bits are kept from the state
+constexpr uint32_t JIT_STATUS_FLAGS = 0x8D5;
+
+struct VMJitEmitter {
+	uint8_t* code;
+	uint32_t size;
+	bool overflow;
+
+	void Byte(uint8_t value) {
+		if (size < VM_JIT_BUFFER_SIZE) {
+			code[size++] = value;
+		}
+		else {
+			overflow = true;
+		}
+	}
+
+	void Dword(uint32_t value) {
+		for (int i = 0; i < 4; i++) {
+			Byte(static_cast<uint8_t>(value >> (i * 8)));
+		}
+	}
+
+	void Qword(uint64_t value) {
+		Dword(static_cast<uint32_t>(value));
+		Dword(static_cast<uint32_t>(value >> 32));
+	}
+};
+
+// [opcode] reg, [r11 + offset] on the full register
+inline void EmitState(VMJitEmitter& emitter, uint8_t opcode, uint8_t reg, uint32_t offset) {
+	emitter.Byte(0x49 | ((reg & 8) ? 0x04 : 0));
+	emitter.Byte(opcode);
+	emitter.Byte(0x80 | ((reg & 7) << 3) | 3);
+	emitter.Dword(offset);
+}
+
+inline void EmitLoad(VMJitEmitter& emitter, uint8_t reg, uint32_t offset) {
+	EmitState(emitter, 0x8B, reg, offset);
+}
+
+inline void EmitStore(VMJitEmitter& emitter, uint32_t offset, uint8_t reg) {
+	EmitState(emitter, 0x89, reg, offset);
+}
+
+// mov reg, imm64, leaves the flags alone
+inline void EmitImmediate(VMJitEmitter& emitter, uint8_t reg, uint64_t value) {
+	emitter.Byte(0x48 | ((reg & 8) ? 0x01 : 0));
+	emitter.Byte(0xB8 | (reg & 7));
+	emitter.Qword(value);
+}
+
+// Moves the status flags of the state into rflags
+inline void EmitEnter(VMJitEmitter& emitter) {
+#ifdef _WIN32
+	emitter.Byte(0x49); emitter.Byte(0x89); emitter.Byte(0xCB);
+#else
+	emitter.Byte(0x49); emitter.Byte(0x89); emitter.Byte(0xFB);
+#endif
+	EmitLoad(emitter, JIT_RAX, offsetof(VMState, rflags));
+	emitter.Byte(0x9C);
+	emitter.Byte(0x59);
+	emitter.Byte(0x48); emitter.Byte(0x81); emitter.Byte(0xE1); emitter.Dword(~JIT_STATUS_FLAGS);
+	emitter.Byte(0x25); emitter.Dword(JIT_STATUS_FLAGS);
+	emitter.Byte(0x48); emitter.Byte(0x09); emitter.Byte(0xC1);
+	emitter.Byte(0x51);
+	emitter.Byte(0x9D);
+}
+
+// Moves the status flags back into the state and returns to the dispatcher
+inline void EmitLeave(VMJitEmitter& emitter) {
+	emitter.Byte(0x9C);
+	emitter.Byte(0x58);
+	emitter.Byte(0x25); emitter.Dword(JIT_STATUS_FLAGS);
+	EmitLoad(emitter, JIT_RCX, offsetof(VMState, rflags));
+	emitter.Byte(0x48); emitter.Byte(0x81); emitter.Byte(0xE1); emitter.Dword(~JIT_STATUS_FLAGS);
+	emitter.Byte(0x48); emitter.Byte(0x09); emitter.Byte(0xC1);
+	EmitStore(emitter, offsetof(VMState, rflags), JIT_RCX);
+	emitter.Byte(0xC3);
+}
+
+// Computes the address of the memory operand into r10 without touching the flags
+inline void EmitAddress(VMJitEmitter& emitter, const VMInstruction* instruction) {
+	const VMAddress& address = instruction->address;
+
+	// RIP relative operands were rebased onto the image when they were decoded
+	if (address.base == VM_REGISTER_RIP) {
+		EmitImmediate(emitter, JIT_R10, instruction->displacement);
+		return;
+	}
+
+	if (address.hasBase) {
+		EmitLoad(emitter, JIT_R10, address.base * sizeof(uint64_t));
+	}
+	else {
+		emitter.Byte(0x41); emitter.Byte(0xBA); emitter.Dword(0);
+	}
+
+	if (address.hasIndex) {
+		EmitLoad(emitter, JIT_R9, address.index * sizeof(uint64_t));
+	}
+	else {
+		emitter.Byte(0x41); emitter.Byte(0xB9); emitter.Dword(0);
+	}
+
+	// lea r10, [r10 + r9 * scale + displacement]
+	emitter.Byte(0x4F);
+	emitter.Byte(0x8D);
+	emitter.Byte(0x94);
+	emitter.Byte(static_cast<uint8_t>((address.scale << 6) | 0x0A));
+	emitter.Dword(static_cast<uint32_t>(instruction->displacement));
+}
+
+// Operand size prefixes of a math instruction, memory operands are addressed through r10
+inline void EmitPrefix(VMJitEmitter& emitter, uint8_t size, bool memory) {
+	if (size == 2) {
+		emitter.Byte(0x66);
+	}
+
+	uint8_t rex = (size == 8 ? 0x08 : 0) | (memory ? 0x01 : 0);
+
+	if (rex) {
+		emitter.Byte(0x40 | rex);
+	}
+}
+
+// Runs the math operation on rax or [r10] with rcx or [r10] natively so the flags come out exactly as expected
+inline bool EmitMath(VMJitEmitter& emitter, const VMInstruction* instruction, int variant) {
+	// Opcodes of the [r/m], reg and reg, [r/m] forms for Add, Sub, Cmp and Mov
+	constexpr uint8_t store[] = { 0x01, 0x29, 0x39, 0x89 };
+	constexpr uint8_t load[] = { 0x03, 0x2B, 0x3B, 0x8B };
+
+	MathOperation operation = static_cast<MathOperation>(variant / 4 / static_cast<int>(VMShape::Count));
+	VMShape shape = static_cast<VMShape>(variant / 4 % static_cast<int>(VMShape::Count));
+	uint8_t size = static_cast<uint8_t>(1 << (variant % 4));
+	uint8_t narrow = (size == 1) ? 1 : 0;
+
+	const VMOperand& destination = instruction->operands[0];
+	const VMOperand& source = instruction->operands[1];
+
+	// High byte registers cannot be encoded next to the REX prefixes used here
+	if (destination.shift || source.shift) {
+		return false;
+	}
+
+	if (shape == VMShape::RegisterRegister || shape == VMShape::RegisterImmediate || shape == VMShape::RegisterMemory) {
+		EmitLoad(emitter, JIT_RAX, destination.reg * sizeof(uint64_t));
+
+		if (shape == VMShape::RegisterMemory) {
+			EmitAddress(emitter, instruction);
+			EmitPrefix(emitter, size, true);
+			emitter.Byte(load[static_cast<int>(operation)] - narrow);
+			emitter.Byte(0x02);
+		}
+		else {
+			if (shape == VMShape::RegisterRegister) {
+				EmitLoad(emitter, JIT_RCX, source.reg * sizeof(uint64_t));
+			}
+			else {
+				EmitImmediate(emitter, JIT_RCX, instruction->imm);
+			}
+			EmitPrefix(emitter, size, false);
+			emitter.Byte(store[static_cast<int>(operation)] - narrow);
+			emitter.Byte(0xC8);
+		}
+
+		if (operation != MathOperation::Cmp) {
+			EmitStore(emitter, destination.reg * sizeof(uint64_t), JIT_RAX);
+		}
+	}
+	else {
+		EmitAddress(emitter, instruction);
+
+		if (shape == VMShape::MemoryRegister) {
+			EmitLoad(emitter, JIT_RCX, source.reg * sizeof(uint64_t));
+		}
+		else {
+			EmitImmediate(emitter, JIT_RCX, instruction->imm);
+		}
+		EmitPrefix(emitter, size, true);
+		emitter.Byte(store[static_cast<int>(operation)] - narrow);
+		emitter.Byte(0x0A);
+	}
+	return true;
+}
+
+// Pops the return address off the guest stack into rip and leaves
+inline void EmitRet(VMJitEmitter& emitter) {
+	EmitLoad(emitter, JIT_RAX, offsetof(VMState, rsp));
+	emitter.Byte(0x48); emitter.Byte(0x8B); emitter.Byte(0x08);
+	EmitStore(emitter, offsetof(VMState, rip), JIT_RCX);
+	emitter.Byte(0x48); emitter.Byte(0x8D); emitter.Byte(0x40); emitter.Byte(0x08);
+	EmitStore(emitter, offsetof(VMState, rsp), JIT_RAX);
+	EmitLeave(emitter);
+}
+
+// Branches are emitted with a rel32 that is patched once every target has its native offset
+struct VMJitFixup {
+	uint32_t at;
+	uint32_t index;
+};
+
+struct VMJitTranslation {
+	uint32_t indices[VM_JIT_MAX_INSTRUCTIONS];
+	uint32_t offsets[VM_JIT_MAX_INSTRUCTIONS];
+	int translated;
+	uint32_t pending[VM_JIT_MAX_INSTRUCTIONS + 1];
+	int waiting;
+	VMJitFixup fixups[VM_JIT_MAX_INSTRUCTIONS * 2 + 1];
+	int patched;
+
+	int Find(uint32_t index) const {
+		for (int i = 0; i < translated; i++) {
+			if (indices[i] == index) {
+				return i;
+			}
+		}
+		return -1;
+	}
+};
+
+inline void EmitBranch(VMJitEmitter& emitter, VMJitTranslation& translation, uint32_t index) {
+	translation.fixups[translation.patched++] = { emitter.size, index };
+	emitter.Dword(0);
+}
+
+// Random padding between instructions so every translation of a region has a different layout
+inline void EmitPadding(VMJitEmitter& emitter, uint64_t& seed) {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	for (uint64_t i = 0; i < (seed & 3); i++) {
+		emitter.Byte(0x90);
+	}
+}
+
+// Follows the region from its first instruction, every chain of fallthroughs is emitted in order and branch
+// targets are queued, anything the native code cannot express rejects the whole region
+inline bool Translate(VMJitEmitter& emitter, VMState* state, uint32_t index, VMFetch fetch) {
+	VMJitTranslation translation;
+	translation.translated = 0;
+	translation.waiting = 0;
+	translation.patched = 0;
+	translation.pending[translation.waiting++] = index;
+
+	uint64_t seed = __rdtsc() | 1;
+
+	EmitEnter(emitter);
+
+	while (translation.waiting > 0) {
+		uint32_t current = translation.pending[--translation.waiting];
+
+		if (translation.Find(current) >= 0) {
+			continue;
+		}
+
+		while (true) {
+			if (translation.Find(current) >= 0) {
+				emitter.Byte(0xE9);
+				EmitBranch(emitter, translation, current);
+				break;
+			}
+
+			if (translation.translated == VM_JIT_MAX_INSTRUCTIONS) {
+				return false;
+			}
+
+			translation.indices[translation.translated] = current;
+			translation.offsets[translation.translated++] = emitter.size;
+			EmitPadding(emitter, seed);
+
+			const VMInstruction* instruction = fetch(state, current);
+			int opcode = instruction->opcode;
+
+			// A fused entry is its first instruction, the second one still has its own entry at next
+			if (opcode >= static_cast<int>(VMOpcode::Fused)) {
+				opcode = VMFusions[opcode - static_cast<int>(VMOpcode::Fused)][0];
+			}
+
+			if (opcode == static_cast<int>(VMOpcode::Exit)) {
+				EmitLeave(emitter);
+				break;
+			}
+			else if (opcode == static_cast<int>(VMOpcode::Ret)) {
+				EmitRet(emitter);
+				break;
+			}
+			else if (opcode == static_cast<int>(VMOpcode::Jmp)) {
+				current = instruction->target;
+			}
+			else if (opcode == static_cast<int>(VMOpcode::Jcc) && instruction->condition != VMCondition::None) {
+				emitter.Byte(0x0F);
+				emitter.Byte(static_cast<uint8_t>(0x80 + static_cast<int>(instruction->condition) - 1));
+				EmitBranch(emitter, translation, instruction->target);
+				translation.pending[translation.waiting++] = instruction->target;
+				current = instruction->next;
+			}
+			else if (opcode >= static_cast<int>(VMOpcode::Math) && opcode < static_cast<int>(VMOpcode::Fused)) {
+				if (!EmitMath(emitter, instruction, opcode - static_cast<int>(VMOpcode::Math))) {
+					return false;
+				}
+				current = instruction->next;
+			}
+			else {
+				// Anything else stays in the interpreter
+				return false;
+			}
+		}
+	}
+
+	for (int i = 0; i < translation.patched; i++) {
+		const VMJitFixup& fixup = translation.fixups[i];
+		uint32_t target = translation.offsets[translation.Find(fixup.index)];
+		uint32_t relative = target - (fixup.at + 4);
+
+		for (int j = 0; j < 4; j++) {
+			emitter.code[fixup.at + j] = static_cast<uint8_t>(relative >> (j * 8));
+		}
+	}
+	return !emitter.overflow;
+}
+
+inline void Compile(VMJitRegion& region, VMState* state, uint32_t index, VMFetch fetch) {
+	region.state.store(VMJitState::Compiling, std::memory_order_relaxed);
+
+	uint8_t* code = AllocateCode(VM_JIT_BUFFER_SIZE);
+	VMJitEmitter emitter{ code, 0, false };
+
+	if (!code || !Translate(emitter, state, index, fetch) || !SealCode(code, VM_JIT_BUFFER_SIZE)) {
+		if (code) {
+			ReleaseCode(code, VM_JIT_BUFFER_SIZE);
+		}
+		region.state.store(VMJitState::Rejected, std::memory_order_release);
+		return;
+	}
+
+	region.code = reinterpret_cast<VMJitCode>(code);
+	region.runs.store(0, std::memory_order_relaxed);
+	region.state.store(VMJitState::Compiled, std::memory_order_release);
+}
+
+// Takes the native code away from new runs and releases it once the running ones are done
+inline void Retire(VMJitRegion& region, VMState* state, uint32_t index, VMFetch fetch) {
+	VMJitState expected = VMJitState::Compiled;
+
+	if (!region.state.compare_exchange_strong(expected, VMJitState::Compiling)) {
+		return;
+	}
+
+	while (region.active.load() != 0) {
+		_mm_pause();
+	}
+
+	ReleaseCode(reinterpret_cast<uint8_t*>(region.code), VM_JIT_BUFFER_SIZE);
+
+	if constexpr (VM_JIT_POLICY == VMJitPolicy::Rerandomize) {
+		Compile(region, state, index, fetch);
+	}
+	else {
+		region.state.store(VMJitState::Rejected, std::memory_order_release);
+	}
+}
+
+// Counts the entries of the region and runs its native code once it has some, returns false to interpret it
+inline bool RunCompiled(VMState* state, uint32_t index, VMFetch fetch) {
+	uintptr_t entry = reinterpret_cast<uintptr_t>(state->bytecode) + index;
+	VMJitRegion& region = GetRegion(state->bytecode, index);
+	uintptr_t tag = region.tag.load(std::memory_order_relaxed);
+
+	if (tag != entry) {
+		if (tag != 0 || !region.tag.compare_exchange_strong(tag, entry)) {
+			return false;
+		}
+	}
+
+	VMJitState current = region.state.load(std::memory_order_acquire);
+
+	if (current == VMJitState::Counting) {
+		// Exactly one thread sees the count reach the threshold and translates the region
+		if (region.count.fetch_add(1, std::memory_order_relaxed) + 1 != VM_JIT_THRESHOLD) {
+			return false;
+		}
+		Compile(region, state, index, fetch);
+	}
+	else if (current != VMJitState::Compiled) {
+		return false;
+	}
+
+	// Kept code is never freed, so there is nothing to count and threads running it share no writable line
+	if constexpr (VM_JIT_POLICY == VMJitPolicy::Keep) {
+		if (region.state.load(std::memory_order_acquire) != VMJitState::Compiled) {
+			return false;
+		}
+		region.code(state);
+		return true;
+	}
+
+	region.active.fetch_add(1);
+
+	if (region.state.load() != VMJitState::Compiled) {
+		region.active.fetch_sub(1);
+		return false;
+	}
+
+	region.code(state);
+	region.active.fetch_sub(1);
+
+	if (region.runs.fetch_add(1, std::memory_order_relaxed) + 1 == VM_JIT_LIFETIME) {
+		Retire(region, state, index, fetch);
+	}
+	return true;
+}
@@ -1,279 +1,846 @@
+#include <cstddef>
 #include <iostream>
-#include <Windows.h>
-#include "lazy_importer.hpp"
+#include <utility>
+#include "imports.hpp"
 #include "vm.hpp"
+#include "jit.hpp"
 
-void MathImmToMem(MathOperation operation, VMState* state, VMRegister reg0, uint8_t op0Size, uint64_t value0, uint64_t imm) {
-	if (op0Size == 1) {
-		if (operation == MathOperation::Add) {
-			*reinterpret_cast<uint8_t*>(state->registers[reg0]) = value0 + imm;
-		}
-		else if (operation == MathOperation::Sub) {
-			*reinterpret_cast<uint8_t*>(state->registers[reg0]) = value0 - imm;
-		}
+// Decrypts the fields of a bytecode entry as they are read so nothing is copied out of the bytecode
+struct VMDecoder {
+	uint8_t* entry;
+	uint8_t key;
+
+	template<typename T> T Read(int offset) const {
+		T value = *reinterpret_cast<T*>(&entry[offset]);
+		return value ^ static_cast<T>(0x0101010101010101ULL * key);
+	}
+};
+
+constexpr uint64_t Mask(uint8_t size) {
+	return (size == 8) ? ~0ULL : (1ULL << (size * 8)) - 1;
+}
+
+template<uint8_t Size> uint64_t ReadRegister(VMState* state, const VMOperand& operand) {
+	if constexpr (Size == 1) {
+		return (state->registers[operand.reg] >> operand.shift) & Mask(Size);
+	}
+	else {
+		return state->registers[operand.reg] & Mask(Size);
+	}
+}
+
+// Writes like the native instruction would, 32 bit writes clear the upper half and smaller ones preserve it
+template<uint8_t Size> void WriteRegister(VMState* state, const VMOperand& operand, uint64_t value) {
+	if constexpr (Size == 8) {
+		state->registers[operand.reg] = value;
+	}
+	else if constexpr (Size == 4) {
+		state->registers[operand.reg] = value & Mask(4);
+	}
+	else if constexpr (Size == 2) {
+		state->registers[operand.reg] = (state->registers[operand.reg] & ~Mask(2)) | (value & Mask(2));
+	}
+	else {
+		uint64_t mask = Mask(1) << operand.shift;
+		state->registers[operand.reg] = (state->registers[operand.reg] & ~mask) | ((value << operand.shift) & mask);
+	}
+}
+
+template<uint8_t Size> struct Unsigned;
+template<> struct Unsigned<1> { typedef uint8_t Type; };
+template<> struct Unsigned<2> { typedef uint16_t Type; };
+template<> struct Unsigned<4> { typedef uint32_t Type; };
+template<> struct Unsigned<8> { typedef uint64_t Type; };
+
+// Computes base + index * scale + displacement without branching on which parts are present
+uint64_t Address(VMState* state, const VMInstruction* instruction) {
+	const VMAddress& address = instruction->address;
+	uint64_t base = state->registers[address.base & 15] & (0 - static_cast<uint64_t>(address.hasBase));
+	uint64_t index = state->registers[address.index & 15] & (0 - static_cast<uint64_t>(address.hasIndex));
+	return base + (index << address.scale) + instruction->displacement;
+}
+
+template<uint8_t Size> uint64_t ReadMemory(uint64_t address) {
+	return *reinterpret_cast<typename Unsigned<Size>::Type*>(address);
+}
+
+template<uint8_t Size> void WriteMemory(uint64_t address, uint64_t value) {
+	*reinterpret_cast<typename Unsigned<Size>::Type*>(address) = static_cast<typename Unsigned<Size>::Type>(value);
+}
+
+bool Parity(uint64_t value) {
+	uint8_t low = static_cast<uint8_t>(value);
+	low ^= low >> 4;
+	low ^= low >> 2;
+	low ^= low >> 1;
+	return !(low & 1);
+}
+
+// Calculates the result and records what the flags depend on, they are computed by Materialize when needed
+template<MathOperation Operation, uint8_t Size> uint64_t Calculate(VMState* state, uint64_t value0, uint64_t value1) {
+	if constexpr (Operation == MathOperation::Mov) {
+		return value1;
 	}
-	else if (op0Size == 2) {
-		if (operation == MathOperation::Add) {
-			*reinterpret_cast<uint16_t*>(state->registers[reg0]) = value0 + imm;
+	else {
+		uint64_t result;
+
+		if constexpr (Operation == MathOperation::Add) {
+			result = (value0 + value1) & Mask(Size);
 		}
-		else if (operation == MathOperation::Sub) {
-			*reinterpret_cast<uint16_t*>(state->registers[reg0]) = value0 - imm;
+		else {
+			result = (value0 - value1) & Mask(Size);
 		}
+
+		state->flags.value0 = value0;
+		state->flags.value1 = value1;
+		state->flags.result = result;
+		state->flags.sign = 1ULL << (Size * 8 - 1);
+		state->flags.operation = (Operation == MathOperation::Add) ? MathOperation::Add : MathOperation::Sub;
+		state->flags.pending = true;
+
+		return result;
+	}
+}
+
+// Updates rflags the same way the native instruction that produced the pending flags would have
+void Materialize(VMState* state) {
+	VMLazyFlags& flags = state->flags;
+
+	if (!flags.pending) {
+		return;
+	}
+
+	if (flags.operation == MathOperation::Add) {
+		state->cf = flags.result < flags.value0;
+		state->of = ((flags.value0 ^ flags.result) & (flags.value1 ^ flags.result) & flags.sign) != 0;
+	}
+	else {
+		state->cf = flags.value0 < flags.value1;
+		state->of = ((flags.value0 ^ flags.value1) & (flags.value0 ^ flags.result) & flags.sign) != 0;
+	}
+
+	state->af = ((flags.value0 ^ flags.value1 ^ flags.result) & 0x10) != 0;
+	state->zf = flags.result == 0;
+	state->sf = (flags.result & flags.sign) != 0;
+	state->pf = Parity(flags.result);
+
+	flags.pending = false;
+}
+
+bool Condition(VMState* state, VMCondition condition) {
+	Materialize(state);
+
+	if (condition == VMCondition::O) {
+		return state->of;
+	}
+	else if (condition == VMCondition::NO) {
+		return !state->of;
+	}
+	else if (condition == VMCondition::B) {
+		return state->cf;
+	}
+	else if (condition == VMCondition::AE) {
+		return !state->cf;
+	}
+	else if (condition == VMCondition::E) {
+		return state->zf;
+	}
+	else if (condition == VMCondition::NE) {
+		return !state->zf;
+	}
+	else if (condition == VMCondition::BE) {
+		return state->cf || state->zf;
+	}
+	else if (condition == VMCondition::A) {
+		return !state->cf && !state->zf;
 	}
-	else if (op0Size == 4) {
-		if (operation == MathOperation::Add) {
-			*reinterpret_cast<uint32_t*>(state->registers[reg0]) = value0 + imm;
+	else if (condition == VMCondition::S) {
+		return state->sf;
+	}
+	else if (condition == VMCondition::NS) {
+		return !state->sf;
+	}
+	else if (condition == VMCondition::P) {
+		return state->pf;
+	}
+	else if (condition == VMCondition::NP) {
+		return !state->pf;
+	}
+	else if (condition == VMCondition::L) {
+		return state->sf != state->of;
+	}
+	else if (condition == VMCondition::GE) {
+		return state->sf == state->of;
+	}
+	else if (condition == VMCondition::LE) {
+		return state->zf || state->sf != state->of;
+	}
+	else if (condition == VMCondition::G) {
+		return !state->zf && state->sf == state->of;
+	}
+	return true;
+}
+
+VMRuntime runtime;
+
+void SetAddress(VMInstruction* instruction, uint8_t base, uint8_t index, uint8_t scale, int32_t displacement) {
+	VMAddress& address = instruction->address;
+	address.base = base;
+	address.index = index;
+	address.scale = scale;
+	address.hasBase = base < VM_REGISTER_RIP;
+	address.hasIndex = index < VM_REGISTER_RIP;
+	instruction->displacement = displacement;
+
+	// RIP relative operands store the RVA of their target
+	if (base == VM_REGISTER_RIP) {
+		instruction->displacement = runtime.image + static_cast<uint32_t>(displacement);
+	}
+}
+
+// Parses an entry laid out as [opcode] [operand count] followed by [kind] [size] and then [register] [part],
+// [base] [index] [scale] [displacement], an 8 byte immediate or [condition] [target] for every operand
+void DecodeVariable(VMState* state, uint32_t index, VMInstruction* instruction) {
+	uint8_t length = state->bytecode[index];
+	VMDecoder decoder{ &state->bytecode[index + 1], static_cast<uint8_t>(index) };
+
+	*instruction = {};
+	instruction->handler = state->handlers->table[decoder.Read<uint8_t>(0)];
+	instruction->opcode = runtime.opcodes[decoder.Read<uint8_t>(0)];
+	instruction->next = index + 1 + length;
+
+	uint8_t count = (length > 1) ? decoder.Read<uint8_t>(1) : 0;
+	int offset = 2;
+
+	for (uint8_t i = 0; i < count && i < 2; i++) {
+		VMOperand& operand = instruction->operands[i];
+		operand.kind = decoder.Read<uint8_t>(offset);
+
+		VMOpKind kind = static_cast<VMOpKind>(operand.kind);
+
+		if (kind == VMOpKind::Register) {
+			operand.size = decoder.Read<uint8_t>(offset + 1);
+			operand.reg = decoder.Read<uint8_t>(offset + 2);
+			operand.shift = (static_cast<VMRegisterPart>(decoder.Read<uint8_t>(offset + 3)) == VMRegisterPart::Higher) ? 8 : 0;
+			offset += 4;
 		}
-		else if (operation == MathOperation::Sub) {
-			*reinterpret_cast<uint32_t*>(state->registers[reg0]) = value0 - imm;
+		else if (kind == VMOpKind::Memory) {
+			operand.size = decoder.Read<uint8_t>(offset + 1);
+			SetAddress(instruction, decoder.Read<uint8_t>(offset + 2), decoder.Read<uint8_t>(offset + 3), decoder.Read<uint8_t>(offset + 4), decoder.Read<int32_t>(offset + 5));
+			offset += 9;
 		}
-	}
-	else if (op0Size == 8) {
-		if (operation == MathOperation::Add) {
-			*reinterpret_cast<uint64_t*>(state->registers[reg0]) = value0 + imm;
+		else if (kind == VMOpKind::NearBranch64) {
+			instruction->condition = static_cast<VMCondition>(decoder.Read<uint8_t>(offset + 1));
+			instruction->target = decoder.Read<int32_t>(offset + 2);
+			offset += 6;
 		}
-		else if (operation == MathOperation::Sub) {
-			*reinterpret_cast<uint64_t*>(state->registers[reg0]) = value0 - imm;
+		else {
+			operand.size = decoder.Read<uint8_t>(offset + 1);
+			instruction->imm = decoder.Read<uint64_t>(offset + 2);
+			offset += 10;
 		}
 	}
 }
 
-template<typename T> void HandleMathImm(MathOperation operation, VMState* state, uint8_t* bytecode) {
-	VMOpKind op0Kind = static_cast<VMOpKind>(bytecode[3]);
-	uint8_t op0Size = bytecode[4];
-	VMRegister reg0 = static_cast<VMRegister>(bytecode[5]);
-	VMRegisterPart part0 = static_cast<VMRegisterPart>(bytecode[6]);
+// Parses a 16 byte entry with two aligned loads, the first word holds [opcode] [kinds] [register 0] [register 1]
+// [base] [index] [scale or condition] [flags] and the second [displacement or target] [immediate or pool slot]
+void DecodeFixed(VMState* state, uint32_t index, VMInstruction* instruction) {
+	VMDecoder decoder{ &state->bytecode[index], static_cast<uint8_t>(index >> 4) };
 
-	T imm = *reinterpret_cast<T*>(&bytecode[9]);
+	uint64_t low = decoder.Read<uint64_t>(0);
+	uint64_t high = decoder.Read<uint64_t>(8);
 
-	uint64_t op0Mask = (op0Size == 8) ? ~0ULL : (1ULL << (op0Size * 8)) - 1;
+	*instruction = {};
+	instruction->handler = state->handlers->table[low & 0xFF];
+	instruction->opcode = runtime.opcodes[low & 0xFF];
+	instruction->next = index + VM_FIXED_SIZE;
 
-	uint64_t value0 = (state->registers[reg0] >> (part0 == VMRegisterPart::Higher ? 8 : 0)) & op0Mask;
+	for (int i = 0; i < 2; i++) {
+		VMOperand& operand = instruction->operands[i];
+		VMFixedKind kind = static_cast<VMFixedKind>((low >> (8 + i * 4)) & 15);
+		uint8_t reg = static_cast<uint8_t>(low >> (16 + i * 8));
 
-	if (op0Kind == VMOpKind::Register) {
-		if (operation == MathOperation::Add) {
-			state->registers[reg0] = value0 + imm;
+		if (kind == VMFixedKind::Register) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Register);
+			operand.reg = reg & 15;
+			operand.shift = (reg & 16) ? 8 : 0;
 		}
-		else if (operation == MathOperation::Sub) {
-			state->registers[reg0] = value0 - imm;
+		else if (kind == VMFixedKind::Memory) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Memory);
+			SetAddress(instruction, static_cast<uint8_t>(low >> 32), static_cast<uint8_t>(low >> 40), static_cast<uint8_t>(low >> 48), static_cast<int32_t>(high));
+		}
+		else if (kind == VMFixedKind::Branch) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::NearBranch64);
+			instruction->condition = static_cast<VMCondition>(low >> 48);
+			instruction->target = static_cast<uint32_t>(high);
+		}
+		else if (kind == VMFixedKind::Immediate) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Immediate64);
+			instruction->imm = static_cast<int64_t>(static_cast<int32_t>(high >> 32));
+
+			// Immediates that do not fit in 32 bits are spilled to the constant pool behind the entries
+			if ((low >> 56) & 1) {
+				uint32_t slot = static_cast<uint32_t>(high >> 32);
+				uint32_t pool = *reinterpret_cast<uint32_t*>(&state->bytecode[VM_HEADER_POOL]);
+				VMDecoder constant{ &state->bytecode[pool + slot * sizeof(uint64_t)], static_cast<uint8_t>(slot) };
+				instruction->imm = constant.Read<uint64_t>(0);
+			}
 		}
 	}
-	else if (op0Kind == VMOpKind::Memory) {
-		MathImmToMem(operation, state, reg0, op0Size, value0, imm);
+}
+
+uint64_t ReadVarint(const VMDecoder& decoder, int& offset) {
+	uint64_t value = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		uint8_t byte = decoder.Read<uint8_t>(offset++);
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+		if (!(byte & 0x80)) {
+			break;
+		}
 	}
+	return value;
+}
+
+int64_t ZigZag(uint64_t value) {
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
 }
 
-void HandleMath(MathOperation operation, VMState* state, uint8_t* bytecode) {
-	VMOpKind op0Kind = static_cast<VMOpKind>(bytecode[3]);
-	uint8_t op0Size = bytecode[4];
-	VMRegister reg0 = static_cast<VMRegister>(bytecode[5]);
-	VMRegisterPart part0 = static_cast<VMRegisterPart>(bytecode[6]);
+// Parses an entry laid out as [opcode] [kinds] followed by [register 1 | register 0] when there is a register,
+// [descriptor] [displacement] for memory, an immediate or [condition] [target] for a branch, numbers are varints
+void DecodeCompact(VMState* state, uint32_t index, VMInstruction* instruction) {
+	VMDecoder decoder{ &state->bytecode[index], static_cast<uint8_t>(index) };
 
-	VMOpKind op1Kind = static_cast<VMOpKind>(bytecode[7]);
-	uint8_t op1Size = bytecode[8];
+	*instruction = {};
+	instruction->handler = state->handlers->table[decoder.Read<uint8_t>(0)];
+	instruction->opcode = runtime.opcodes[decoder.Read<uint8_t>(0)];
 
-	uint64_t op0Mask = (op0Size == 8) ? ~0ULL : (1ULL << (op0Size * 8)) - 1;
-	uint64_t op1Mask = (op1Size == 8) ? ~0ULL : (1ULL << (op1Size * 8)) - 1;
+	uint8_t kinds = decoder.Read<uint8_t>(1);
+	int offset = 2;
 
-	if (op1Kind == VMOpKind::Register) {
-		VMRegister reg1 = static_cast<VMRegister>(bytecode[9]);
-		VMRegisterPart part1 = static_cast<VMRegisterPart>(bytecode[10]);
+	if ((kinds & 3) == static_cast<uint8_t>(VMCompactKind::Register) || ((kinds >> 2) & 3) == static_cast<uint8_t>(VMCompactKind::Register)) {
+		uint8_t registers = decoder.Read<uint8_t>(offset++);
+		instruction->operands[0].reg = registers & 15;
+		instruction->operands[1].reg = registers >> 4;
+	}
 
-		uint64_t value0 = (state->registers[reg0] >> (part0 == VMRegisterPart::Higher ? 8 : 0)) & op0Mask;
-		uint64_t value1 = (state->registers[reg1] >> (part1 == VMRegisterPart::Higher ? 8 : 0)) & op1Mask;
+	for (int i = 0; i < 2; i++) {
+		VMOperand& operand = instruction->operands[i];
+		VMCompactKind kind = static_cast<VMCompactKind>((kinds >> (i * 2)) & 3);
 
-		if (op0Kind == VMOpKind::Register) {
-			if (operation == MathOperation::Add) {
-				state->registers[reg0] = value0 + value1;
-			}
-			else if (operation == MathOperation::Sub) {
-				state->registers[reg0] = value0 - value1;
-			}
+		if (kind == VMCompactKind::Register) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Register);
+			operand.shift = ((kinds >> (4 + i)) & 1) ? 8 : 0;
 		}
-		else if (op0Kind == VMOpKind::Memory) {
-			if (operation == MathOperation::Add) {
-				uint64_t result = value0 + value1;
-				LI_FN(memcpy)(reinterpret_cast<uint64_t*>(state->registers[reg0]), &result, op0Size);
+		else if (kind == VMCompactKind::Memory) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Memory);
+
+			// Memory operands share their registers through the descriptor table behind the entries
+			uint8_t descriptor = decoder.Read<uint8_t>(offset++);
+			uint8_t base, index, scale;
+
+			if (descriptor == VM_COMPACT_INLINE) {
+				base = decoder.Read<uint8_t>(offset);
+				index = decoder.Read<uint8_t>(offset + 1);
+				scale = decoder.Read<uint8_t>(offset + 2);
+				offset += 3;
 			}
-			else if (operation == MathOperation::Sub) {
-				uint64_t result = value0 - value1;
-				LI_FN(memcpy)(reinterpret_cast<uint64_t*>(state->registers[reg0]), &result, op0Size);
+			else {
+				uint32_t table = *reinterpret_cast<uint32_t*>(&state->bytecode[VM_HEADER_POOL]);
+				VMDecoder shared{ &state->bytecode[table + descriptor * 3], descriptor };
+				base = shared.Read<uint8_t>(0);
+				index = shared.Read<uint8_t>(1);
+				scale = shared.Read<uint8_t>(2);
 			}
+
+			int64_t displacement = ZigZag(ReadVarint(decoder, offset));
+			SetAddress(instruction, base, index, scale, static_cast<int32_t>(displacement));
+		}
+		else if (kind == VMCompactKind::Immediate && (kinds & VM_COMPACT_BRANCH)) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::NearBranch64);
+			instruction->condition = static_cast<VMCondition>(decoder.Read<uint8_t>(offset++));
+			instruction->target = static_cast<uint32_t>(ReadVarint(decoder, offset));
+		}
+		else if (kind == VMCompactKind::Immediate) {
+			operand.kind = static_cast<uint8_t>(VMOpKind::Immediate64);
+			instruction->imm = ZigZag(ReadVarint(decoder, offset));
 		}
 	}
-	else if (op1Kind == VMOpKind::Memory) {
-		VMRegister reg1 = static_cast<VMRegister>(bytecode[9]);
-		VMRegisterPart part1 = static_cast<VMRegisterPart>(bytecode[10]);
 
-		if (part1 == VMRegisterPart::Higher) {
-			op1Mask = op1Mask >> 8;
+	instruction->next = index + offset;
+}
+
+void Decode(VMState* state, uint32_t index, VMInstruction* instruction) {
+	VMFormat format = static_cast<VMFormat>(state->bytecode[VM_HEADER_FORMAT]);
+
+	if (format == VMFormat::Fixed) {
+		DecodeFixed(state, index, instruction);
+	}
+	else if (format == VMFormat::Compact) {
+		DecodeCompact(state, index, instruction);
+	}
+	else {
+		DecodeVariable(state, index, instruction);
+	}
+}
+
+constexpr uint32_t VM_CONTEXT_NONE = 0xFFFFFFFF;
+
+// Runs when a thread exits with the slab it allocated
+void ReleaseContext(void* context) {
+	if (context) {
+		VM_IMPORT(Free, free)(static_cast<VMContext*>(context)->memory);
+	}
+}
+
+// Fiber local storage is used on Windows since only it calls back on thread exit
+void CreateContextSlot() {
+#ifdef _WIN32
+	runtime.context = VM_IMPORT(FlsAlloc, FlsAlloc)(ReleaseContext);
+#else
+	pthread_key_t key;
+	runtime.context = pthread_key_create(&key, ReleaseContext) ? VM_CONTEXT_NONE : static_cast<uint32_t>(key);
+#endif
+}
+
+// Looked up once per activation, the first activation on a thread allocates its slab
+// A protected image has a single blob, a thread only moves on to another one when a host runs several and then starts over
+VMContext* GetContext(uint8_t* bytecode) {
+	if (runtime.context == VM_CONTEXT_NONE) {
+		return nullptr;
+	}
+
+#ifdef _WIN32
+	VMContext* context = static_cast<VMContext*>(VM_IMPORT(FlsGetValue, FlsGetValue)(runtime.context));
+#else
+	VMContext* context = static_cast<VMContext*>(pthread_getspecific(runtime.context));
+#endif
+
+	if (context) {
+		if (context->bytecode != bytecode) {
+			for (VMCacheEntry& entry : context->cache.entries) {
+				entry.tag = 0;
+			}
+			context->bytecode = bytecode;
 		}
+		return context;
+	}
+
+	uint8_t* memory = static_cast<uint8_t*>(VM_IMPORT(Calloc, calloc)(1, sizeof(VMContext) + alignof(VMContext)));
+
+	if (!memory) {
+		return nullptr;
+	}
 
-		uint64_t value0 = (state->registers[reg0] >> (part0 == VMRegisterPart::Higher ? 8 : 0)) & op0Mask;
+	context = reinterpret_cast<VMContext*>((reinterpret_cast<uintptr_t>(memory) + alignof(VMContext) - 1) & ~(alignof(VMContext) - 1));
+	context->memory = memory;
+	context->bytecode = bytecode;
 
-		uint64_t value1;
-		LI_FN(memcpy)(&value1, reinterpret_cast<uint64_t*>(state->registers[reg1]), op1Size);
+#ifdef _WIN32
+	bool stored = VM_IMPORT(FlsSetValue, FlsSetValue)(runtime.context, context);
+#else
+	bool stored = pthread_setspecific(runtime.context, context) == 0;
+#endif
 
-		value1 >>= (part1 == VMRegisterPart::Higher ? 8 : 0) & op0Mask;
+	if (!stored) {
+		VM_IMPORT(Free, free)(memory);
+		return nullptr;
+	}
+	return context;
+}
+
+// Decodes every entry once and serves it from the cache of the thread after
+// Handlers run straight on the cached entry, only this thread writes the cache and each handler is done with its entry
+// before it fetches the next one. The copy owned by the activation is only used without a cache or when the entry is wiped
+const VMInstruction* Fetch(VMState* state, uint32_t index) {
+	if (!state->context) {
+		Decode(state, index, state->instruction);
+		return state->instruction;
+	}
+
+	VMCacheEntry* entry = &state->context->cache.entries[index % VM_CACHE_SIZE];
 
-		if (operation == MathOperation::Add) {
-			state->registers[reg0] = value0 + value1;
+	if (entry->tag == index + 1) {
+#if VM_CACHE_WIPE_USES
+		if (++entry->uses >= VM_CACHE_WIPE_USES) {
+			*state->instruction = entry->instruction;
+			*entry = {};
+			return state->instruction;
 		}
-		else if (operation == MathOperation::Sub) {
-			state->registers[reg0] = value0 - value1;
+#endif
+		return &entry->instruction;
+	}
+
+	Decode(state, index, &entry->instruction);
+	entry->tag = index + 1;
+	entry->uses = 0;
+	return &entry->instruction;
+}
+
+// Where the tail call is guaranteed every handler calls the next one so there is no return to the dispatcher between
+// instructions. Any other compiler may keep a frame per call, unoptimized builds always do, and a guest loop would grow
+// the stack with its iteration count, so there the handlers return the next instruction to the loop in VMDispatcher
+#if defined(__clang__) && defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define VM_CHAINED 1
+#endif
+#endif
+
+#ifndef VM_CHAINED
+#define VM_CHAINED 0
+#endif
+
+// Handlers never have buffers worth a stack cookie, the check would only sit on the hot path
+#if defined(_WIN32)
+#define VM_SAFEBUFFERS __declspec(safebuffers)
+#else
+#define VM_SAFEBUFFERS
+#endif
+
+#if VM_PROFILE
+// Maps the profile file, without it the counters are kept in memory only
+VMProfile* MapProfile() {
+	VMProfile* profile = nullptr;
+#ifdef _WIN32
+	HANDLE file = VM_IMPORT(CreateFileA, CreateFileA)(VM_PROFILE_PATH, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file != INVALID_HANDLE_VALUE) {
+		HANDLE mapping = VM_IMPORT(CreateFileMappingA, CreateFileMappingA)(file, nullptr, PAGE_READWRITE, 0, sizeof(VMProfile), nullptr);
+
+		if (mapping) {
+			profile = static_cast<VMProfile*>(VM_IMPORT(MapViewOfFile, MapViewOfFile)(mapping, FILE_MAP_WRITE, 0, 0, sizeof(VMProfile)));
 		}
 	}
-	else if (op1Kind == VMOpKind::Immediate8) {
-		HandleMathImm<uint8_t>(operation, state, bytecode);
+#else
+	int file = open(VM_PROFILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (file >= 0) {
+		if (ftruncate(file, sizeof(VMProfile)) == 0) {
+			void* view = mmap(nullptr, sizeof(VMProfile), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+			profile = (view != MAP_FAILED) ? static_cast<VMProfile*>(view) : nullptr;
+		}
+		close(file);
 	}
-	else if (op1Kind == VMOpKind::Immediate16) {
-		HandleMathImm<uint16_t>(operation, state, bytecode);
+#endif
+
+	if (!profile) {
+		profile = static_cast<VMProfile*>(VM_IMPORT(Calloc, calloc)(1, sizeof(VMProfile)));
 	}
-	else if (op1Kind == VMOpKind::Immediate8to16) {
-		HandleMathImm<int16_t>(operation, state, bytecode);
+
+	if (profile) {
+		profile->magic = VM_PROFILE_MAGIC;
+		profile->opcodes = static_cast<uint32_t>(VMOpcode::Count);
+		profile->sites = VM_PROFILE_SITES;
+		profile->threads = VM_PROFILE_THREADS;
+		profile->size = sizeof(VMProfileThread);
+		profile->first = offsetof(VMProfile, entries);
+		profile->pairs = offsetof(VMProfileThread, pairs);
 	}
-	else if (op1Kind == VMOpKind::Immediate32) {
-		HandleMathImm<uint32_t>(operation, state, bytecode);
+	return profile;
+}
+
+// Finds the counters owned by the calling thread or claims free ones
+VMProfileThread* GetProfileThread() {
+	if (!runtime.profile) {
+		return nullptr;
 	}
-	else if (op1Kind == VMOpKind::Immediate8to32) {
-		HandleMathImm<int32_t>(operation, state, bytecode);
+
+#ifdef _WIN32
+	uint32_t id = VM_IMPORT(GetCurrentThreadId, GetCurrentThreadId)();
+#else
+	uint32_t id = static_cast<uint32_t>(gettid());
+#endif
+
+	for (uint32_t i = 0; i < VM_PROFILE_THREADS; i++) {
+		VMProfileThread* thread = &runtime.profile->entries[(id + i) % VM_PROFILE_THREADS];
+		uint32_t owner = thread->owner.load(std::memory_order_relaxed);
+
+		if (owner == id || (owner == 0 && thread->owner.compare_exchange_strong(owner, id))) {
+			return thread;
+		}
 	}
-	else if (op1Kind == VMOpKind::Immediate64) {
-		HandleMathImm<uint64_t>(operation, state, bytecode);
+	return nullptr;
+}
+
+// Charges the cycles since the last dispatch to the instruction that was running
+void Charge(VMProfileThread* thread, uint64_t now) {
+	if (!thread->timing) {
+		return;
 	}
-	else if (op1Kind == VMOpKind::Immediate8to64) {
-		HandleMathImm<int64_t>(operation, state, bytecode);
+
+	uint64_t cycles = now - thread->start;
+	thread->opcodes[thread->opcode].executions++;
+	thread->opcodes[thread->opcode].cycles += cycles;
+
+	VMProfileSite& site = thread->sites[thread->index % VM_PROFILE_SITES];
+
+	if (site.tag == 0) {
+		site.tag = thread->index + 1;
 	}
-	else if (op1Kind == VMOpKind::Immediate32to64) {
-		HandleMathImm<int64_t>(operation, state, bytecode);
+
+	if (site.tag == thread->index + 1) {
+		site.counter.executions++;
+		site.counter.cycles += cycles;
+	}
+	else {
+		thread->collisions++;
 	}
+	thread->timing = false;
 }
 
-__declspec(naked) void LoadRegisters(uint64_t* registers) {
-	__asm {
-		mov rax, [rcx]
-		mov rdx, [rcx + 16]
-		mov rbx, [rcx + 24]
-		//mov rsp, [rcx + 32]
-		//mov rbp, [rcx + 40]
-		mov rsi, [rcx + 48]
-		mov rdi, [rcx + 56]
-		mov r8, [rcx + 64]
-		mov r9, [rcx + 72]
-		mov r10, [rcx + 80]
-		mov r11, [rcx + 88]
-		mov r12, [rcx + 96]
-		mov r13, [rcx + 104]
-		mov r14, [rcx + 112]
-		mov r15, [rcx + 120]
-
-		mov rcx, [rcx + 8]
+// Counts the opcode as following the previous one, a fused opcode counts as its first instruction followed by its second
+void Follow(VMProfileThread* thread, uint32_t opcode) {
+	if (opcode >= static_cast<uint32_t>(VMOpcode::Fused)) {
+		const int* fusion = VMFusions[opcode - static_cast<uint32_t>(VMOpcode::Fused)];
+		Follow(thread, fusion[0]);
+		Follow(thread, fusion[1]);
+		return;
+	}
 
-		ret
+	if (thread->previous) {
+		thread->pairs[thread->previous - 1][opcode]++;
 	}
+	thread->previous = opcode + 1;
 }
 
-__declspec(safebuffers) void LoadFlags(uint64_t flags) {
-	__asm {
-		push flags
-		popfq
+void Record(VMState* state, const VMInstruction* instruction, uint32_t index) {
+	VMProfileThread* thread = state->profile;
+
+	if (!thread) {
+		return;
 	}
+
+	uint64_t now = __rdtsc();
+	Charge(thread, now);
+	Follow(thread, instruction->opcode);
+
+	thread->opcode = instruction->opcode;
+	thread->index = index;
+	thread->start = now;
+	thread->timing = true;
+}
+
+#define VM_RECORD(state, instruction, index) Record(state, instruction, index)
+#else
+#define VM_RECORD(state, instruction, index)
+#endif
+
+#define VM_HANDLER(name) VM_SAFEBUFFERS const VMInstruction* name(VMState* state, const VMInstruction* instruction)
+
+#if VM_CHAINED
+#define VM_DISPATCH(index) { const VMInstruction* fetched = Fetch(state, index); VM_RECORD(state, fetched, index); [[clang::musttail]] return fetched->handler(state, fetched); }
+#else
+#define VM_DISPATCH(index) { const VMInstruction* fetched = Fetch(state, index); VM_RECORD(state, fetched, index); return fetched; }
+#endif
+
+VM_HANDLER(HandleExit) {
+	(void)state;
+	(void)instruction;
+	return nullptr;
 }
 
-// Move physical to virtual state
-__declspec(safebuffers) VMState* VMEntry() {
-	uint64_t registers[16];
+// Instantiated for every math variant so the operation, operand kinds and size are known at compile time
+template<int Variant> void ExecuteMath(VMState* state, const VMInstruction* instruction) {
+	constexpr MathOperation operation = static_cast<MathOperation>(Variant / 4 / static_cast<int>(VMShape::Count));
+	constexpr VMShape shape = static_cast<VMShape>(Variant / 4 % static_cast<int>(VMShape::Count));
+	constexpr uint8_t size = 1 << (Variant % 4);
+
+	constexpr bool memory = shape == VMShape::MemoryRegister || shape == VMShape::MemoryImmediate;
+
+	const VMOperand& destination = instruction->operands[0];
+	const VMOperand& source = instruction->operands[1];
+
+	uint64_t value0 = 0;
+	uint64_t value1;
+
+	uint64_t address = 0;
+
+	if constexpr (memory || shape == VMShape::RegisterMemory) {
+		address = Address(state, instruction);
+	}
+
+	if constexpr (operation != MathOperation::Mov) {
+		value0 = memory ? ReadMemory<size>(address) : ReadRegister<size>(state, destination);
+	}
 
-	__asm {
-		mov[registers], rax
-		mov[registers + 8], rcx
-		mov[registers + 16], rdx
-		mov[registers + 24], rbx
-		mov[registers + 32], rsp
-		mov[registers + 40], rbp
-		mov[registers + 48], rsi
-		mov[registers + 56], rdi
-		mov[registers + 64], r8
-		mov[registers + 72], r9
-		mov[registers + 80], r10
-		mov[registers + 88], r11
-		mov[registers + 96], r12
-		mov[registers + 104], r13
-		mov[registers + 112], r14
-		mov[registers + 120], r15
+	if constexpr (shape == VMShape::RegisterMemory) {
+		value1 = ReadMemory<size>(address);
+	}
+	else if constexpr (shape == VMShape::RegisterImmediate || shape == VMShape::MemoryImmediate) {
+		value1 = instruction->imm & Mask(size);
+	}
+	else {
+		value1 = ReadRegister<size>(state, source);
 	}
 
-	uint64_t flags;
+	uint64_t result = Calculate<operation, size>(state, value0, value1);
 
-	__asm {
-		pushfq
-		pop flags
+	if constexpr (operation != MathOperation::Cmp) {
+		if constexpr (memory) {
+			WriteMemory<size>(address, result);
+		}
+		else {
+			WriteRegister<size>(state, destination, result);
+		}
 	}
+}
+
+template<int Variant> VM_HANDLER(HandleMath) {
+	ExecuteMath<Variant>(state, instruction);
+
+	VM_DISPATCH(instruction->next);
+}
+
+template<int... Variants> void RegisterMath(VMHandlers& handlers, uint8_t* bytecode, std::integer_sequence<int, Variants...>) {
+	((handlers.table[bytecode[static_cast<int>(VMOpcode::Math) + Variants]] = HandleMath<Variants>), ...);
+}
+
+VM_HANDLER(HandleJmp) {
+	VM_DISPATCH(instruction->target);
+}
 
-	VMState* state = reinterpret_cast<VMState*>(LI_FN(malloc)(sizeof(VMState)));
-	LI_FN(memset)(state, 0, sizeof(VMState));
-	LI_FN(memcpy)(state->registers, registers, sizeof(state->registers));
-	LI_FN(memcpy)(&state->rflags, &flags, sizeof(flags));
+VM_HANDLER(HandleJcc) {
+	uint32_t next = Condition(state, instruction->condition) ? instruction->target : instruction->next;
 
-	return state;
+	VM_DISPATCH(next);
 }
 
-uint8_t* Decrypt(uint8_t* bytes, uint8_t length, int key)
-{
-	uint8_t* decrpyted = reinterpret_cast<uint8_t*>(LI_FN(malloc)(length));
+// Runs any math or branch opcode and returns the bytecode index to continue at
+template<int Opcode> uint32_t Execute(VMState* state, const VMInstruction* instruction) {
+	if constexpr (Opcode == static_cast<int>(VMOpcode::Jmp)) {
+		return instruction->target;
+	}
+	else if constexpr (Opcode == static_cast<int>(VMOpcode::Jcc)) {
+		return Condition(state, instruction->condition) ? instruction->target : instruction->next;
+	}
+	else {
+		static_assert(Opcode >= static_cast<int>(VMOpcode::Math) && Opcode < static_cast<int>(VMOpcode::Fused), "Only math and branches can be fused");
 
-	for (int i = 0; i < length; i++)
-	{
-		decrpyted[i] = bytes[i] ^ key;
+		ExecuteMath<Opcode - static_cast<int>(VMOpcode::Math)>(state, instruction);
+		return instruction->next;
 	}
-	return decrpyted;
 }
 
-__declspec(safebuffers) void VMDispatcher(VMState* state, uint8_t* bytecode, int index) {
-	uint8_t length = bytecode[index];
-	uint8_t* decrypted = Decrypt(&bytecode[index + 1], length, index);
+// Runs both instructions of a pair with a single dispatch, the second one keeps its own entry so branches can still reach it
+template<int Fusion> VM_HANDLER(HandleFused) {
+	uint32_t next = Execute<VMFusions[Fusion][0]>(state, instruction);
 
-	VMMnemonic opCode = static_cast<VMMnemonic>(*reinterpret_cast<uint16_t*>(&decrypted[0]));
+	if (next == instruction->next) {
+		const VMInstruction* second = Fetch(state, next);
+		next = Execute<VMFusions[Fusion][1]>(state, second);
+	}
 
-	if (opCode == VMMnemonic::Add) {
-		HandleMath(MathOperation::Add, state, decrypted);
+	VM_DISPATCH(next);
+}
+
+template<int... Fusions> void RegisterFused(VMHandlers& handlers, uint8_t* bytecode, std::integer_sequence<int, Fusions...>) {
+	((handlers.table[bytecode[static_cast<int>(VMOpcode::Fused) + Fusions]] = HandleFused<Fusions>), ...);
+}
+
+static_assert(sizeof(VMFusions) / sizeof(VMFusions[0]) == static_cast<int>(VMOpcode::Count) - static_cast<int>(VMOpcode::Fused), "Every fusion needs an opcode");
+
+// Leaves the VM through the return address on the guest stack
+VM_HANDLER(HandleRet) {
+	(void)instruction;
+	state->rip = *reinterpret_cast<uint64_t*>(state->rsp);
+	state->rsp += sizeof(uint64_t);
+	return nullptr;
+}
+
+// Runs once per process, the first thread to enter the VM prepares the runtime and the others wait until it is done
+void Initialize(uint8_t* bytecode) {
+	if (runtime.state.load(std::memory_order_acquire) == 2) {
+		return;
 	}
-	else if (opCode == VMMnemonic::Sub) {
-		HandleMath(MathOperation::Sub, state, decrypted);
+
+	uint32_t expected = 0;
+
+	if (!runtime.state.compare_exchange_strong(expected, 1, std::memory_order_acquire)) {
+		while (runtime.state.load(std::memory_order_acquire) != 2) {
+			_mm_pause();
+		}
+		return;
 	}
-	else if (opCode == VMMnemonic::Call) {
-		state->call = *reinterpret_cast<uint64_t*>(&decrypted[4]);
+
+	runtime.image = GetImageBase();
+	runtime.resolved = ResolveImports();
+
+	// The handlers need no imports, without them every activation still runs but decodes each entry it reaches
+	if (runtime.resolved) {
+		CreateContextSlot();
 	}
-	LI_FN(free)(decrypted);
+	else {
+		runtime.context = VM_CONTEXT_NONE;
+	}
+
+	// The bytecode starts with the opcode mapping of this build, assigned one by one so the table stays in code
+	VMHandlers& handlers = runtime.handlers;
+	handlers.table[bytecode[static_cast<int>(VMOpcode::Exit)]] = HandleExit;
+	handlers.table[bytecode[static_cast<int>(VMOpcode::Jmp)]] = HandleJmp;
+	handlers.table[bytecode[static_cast<int>(VMOpcode::Jcc)]] = HandleJcc;
+	handlers.table[bytecode[static_cast<int>(VMOpcode::Ret)]] = HandleRet;
+	RegisterMath(handlers, bytecode, std::make_integer_sequence<int, static_cast<int>(VMOpcode::Fused) - static_cast<int>(VMOpcode::Math)>());
+	RegisterFused(handlers, bytecode, std::make_integer_sequence<int, static_cast<int>(VMOpcode::Count) - static_cast<int>(VMOpcode::Fused)>());
+
+	for (int opcode = 0; opcode < static_cast<int>(VMOpcode::Count); opcode++) {
+		runtime.opcodes[bytecode[opcode]] = static_cast<uint8_t>(opcode);
+	}
+
+#if VM_PROFILE
+	if (runtime.resolved) {
+		runtime.profile = MapProfile();
+	}
+#endif
+
+	runtime.state.store(2, std::memory_order_release);
 }
 
-// Move virtual to physical state
-__declspec(safebuffers) void VMExit(VMState* state) {
-	LoadFlags(state->rflags);
+VM_SAFEBUFFERS void VMDispatcher(VMState* state, uint8_t* bytecode, int index) {
+	Initialize(bytecode);
 
-	uint64_t registers[16];
-	LI_FN(memcpy)(registers, state->registers, sizeof(registers));
+	VMInstruction instruction;
 
-	uint64_t stack = registers[VMRegister::RSP];
-	uint64_t frame = registers[VMRegister::RBP];
+	state->bytecode = bytecode;
+	state->handlers = &runtime.handlers;
+	state->instruction = &instruction;
+	state->flags.pending = false;
+	state->context = GetContext(bytecode);
 
-	uintptr_t image = reinterpret_cast<uintptr_t>(LI_FN(GetModuleHandleA)(nullptr));
-	uintptr_t address = image + state->call;
+#if VM_JIT_THRESHOLD
+	// Hot regions run as native code once they are translated, it keeps rflags up to date itself
+	if (runtime.resolved && RunCompiled(state, index, Fetch)) {
+		return;
+	}
+#endif
 
-	LI_FN(free)(state);
+#if VM_PROFILE
+	state->profile = GetProfileThread();
+#endif
 
-	LoadRegisters(registers);
+	const VMInstruction* current = Fetch(state, index);
+	VM_RECORD(state, current, index);
 
-	__asm {
-		push rax
-		mov rax, address
-		cmp rax, image
-		pop rax
-		jne equal
-		je ignore
+	// A chained build only gets back here once the exit has run
+	while (current) {
+		current = current->handler(state, current);
+	}
 
-		equal:
-			call address
-	ignore:
+#if VM_PROFILE
+	if (state->profile) {
+		Charge(state->profile, __rdtsc());
+		// Pairs never span activations, the next one may start anywhere
+		state->profile->previous = 0;
 	}
-}
\ No newline at end of file
+#endif
+
+	// The entry stub restores rflags from the state so the pending flags have to be written out before leaving
+	Materialize(state);
+}
+
+// The protector emits an entry stub per region that builds the VMState and calls VMDispatcher with it, on System V
+// hosts VMEnter in entry_sysv.S does the same for any region
+static_assert(sizeof(VMState) == 256, "Entry stubs reserve 256 bytes for the VMState");
+static_assert(offsetof(VMState, rflags) == 128, "Entry stubs store rflags at offset 128");
+static_assert(offsetof(VMState, rip) == 136, "Entry stubs store rip at offset 136");
+static_assert(sizeof(VMCacheEntry) == 64, "Cache entries should fill exactly one cache line");
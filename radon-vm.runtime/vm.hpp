@@ -1,7 +1,25 @@
 #pragma once
 #include <cstdint>
+#include <atomic>
 
-struct VMState {
+struct VMInstruction;
+struct VMHandlers;
+struct VMProfileThread;
+struct VMContext;
+enum class MathOperation;
+
+// Inputs and result of the last flag producing operation, rflags is only brought up to date once something reads it
+struct VMLazyFlags {
+	uint64_t value0;
+	uint64_t value1;
+	uint64_t result;
+	uint64_t sign;
+	MathOperation operation;
+	bool pending;
+};
+
+// Lives on the native stack for the duration of a VM activation
+struct alignas(64) VMState {
 	union {
 		uint64_t registers[16];
 		struct {
@@ -49,7 +67,17 @@ struct VMState {
 			uint64_t id : 1;
 		};
 	};
-	uint64_t call;
+	// Where execution continues once the VM exits
+	uint64_t rip;
+	// Bytecode, handler table and decode buffer of the running activation
+	uint8_t* bytecode;
+	const VMHandlers* handlers;
+	VMInstruction* instruction;
+	VMLazyFlags flags;
+	// Counters of the running thread in instrumented builds
+	VMProfileThread* profile;
+	// Slab of the running thread, null when it could not be allocated
+	VMContext* context;
 };
 
 enum class VMMnemonic {
@@ -1983,9 +2011,281 @@ enum class VMRegisterPart {
 };
 enum class MathOperation {
 	Add,
-	Sub
+	Sub,
+	Cmp,
+	Mov,
+	Count
+};
+// Destination and source kinds a math instruction can have
+enum class VMShape {
+	RegisterRegister,
+	RegisterMemory,
+	RegisterImmediate,
+	MemoryRegister,
+	MemoryImmediate,
+	Count
+};
+// Same order as Iced's ConditionCode which the virtualizer writes into branches
+enum class VMCondition : uint8_t {
+	None,
+	O,
+	NO,
+	B,
+	AE,
+	E,
+	NE,
+	BE,
+	A,
+	S,
+	NS,
+	P,
+	NP,
+	L,
+	GE,
+	LE,
+	G
 };
 enum class StackOperation {
 	Push,
 	Pop
 };
+// Dense handler numbering, the virtualizer shuffles it per build and stores the mapping in front of the bytecode
+enum class VMOpcode : uint8_t {
+	Exit,
+	Jmp,
+	Jcc,
+	Ret,
+	// First of the math handlers specialized on operation, shape and operand size
+	// They are numbered [operation] [shape] [size] where the size is stored as log2 of its bytes
+	Math,
+	// First of the handlers that run a pair of instructions with one dispatch, see VMFusions
+	Fused = Math + static_cast<int>(MathOperation::Count) * static_cast<int>(VMShape::Count) * 4,
+	Count = Fused + 12
+};
+
+// How the entries of a bytecode blob are encoded, stored in its header
+enum class VMFormat : uint8_t {
+	// [length] followed by the encrypted fields
+	Variable,
+	// 16 bytes per entry with large immediates in a constant pool
+	Fixed,
+	// Packed registers, varint immediates and shared memory operand descriptors
+	Compact
+};
+
+// Operand kinds of the fixed format, four bits each
+enum class VMFixedKind : uint8_t {
+	None,
+	Register,
+	Memory,
+	Immediate,
+	Branch
+};
+
+constexpr int VM_FIXED_SIZE = 16;
+
+// Operand kinds of the compact format, two bits each followed by the high byte flags and the branch flag
+enum class VMCompactKind : uint8_t {
+	None,
+	Register,
+	Memory,
+	Immediate
+};
+
+constexpr uint8_t VM_COMPACT_BRANCH = 0x40;
+// Descriptor number of a memory operand that carries its [base] [index] [scale] inline
+constexpr uint8_t VM_COMPACT_INLINE = 0xFF;
+
+// The header holds the opcode mapping of the build, the format and the offset of the constant pool or descriptor table
+constexpr int VM_HEADER_FORMAT = static_cast<int>(VMOpcode::Count);
+constexpr int VM_HEADER_POOL = (VM_HEADER_FORMAT + 1 + 3) & ~3;
+constexpr int VM_HEADER_SIZE = (VM_HEADER_POOL + 4 + VM_FIXED_SIZE - 1) & ~(VM_FIXED_SIZE - 1);
+
+constexpr int MathOpcode(MathOperation operation, VMShape shape, uint8_t size) {
+	int variant = static_cast<int>(operation) * static_cast<int>(VMShape::Count) + static_cast<int>(shape);
+	return static_cast<int>(VMOpcode::Math) + variant * 4 + (size == 8 ? 3 : size / 2);
+}
+
+// Opcode pairs with a fused handler, the virtualizer only emits those its execution profile asks for
+// Same order as the fusions of the virtualizer
+constexpr int VMFusions[][2] = {
+	{ MathOpcode(MathOperation::Cmp, VMShape::RegisterRegister, 4), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Cmp, VMShape::RegisterRegister, 8), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Cmp, VMShape::RegisterImmediate, 4), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Cmp, VMShape::RegisterImmediate, 8), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Sub, VMShape::RegisterImmediate, 4), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Sub, VMShape::RegisterImmediate, 8), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Add, VMShape::RegisterImmediate, 4), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Add, VMShape::RegisterImmediate, 8), static_cast<int>(VMOpcode::Jcc) },
+	{ MathOpcode(MathOperation::Mov, VMShape::RegisterRegister, 4), MathOpcode(MathOperation::Add, VMShape::RegisterRegister, 4) },
+	{ MathOpcode(MathOperation::Mov, VMShape::RegisterRegister, 8), MathOpcode(MathOperation::Add, VMShape::RegisterRegister, 8) },
+	{ MathOpcode(MathOperation::Mov, VMShape::RegisterRegister, 4), MathOpcode(MathOperation::Add, VMShape::RegisterImmediate, 4) },
+	{ MathOpcode(MathOperation::Mov, VMShape::RegisterRegister, 8), MathOpcode(MathOperation::Add, VMShape::RegisterImmediate, 8) }
+};
+
+// Returns the next instruction to run or nullptr to leave the VM, handlers that chain into the next one return what the
+// last handler of the chain returned
+typedef const VMInstruction* (*VMHandler)(VMState* state, const VMInstruction* instruction);
+
+struct VMHandlers {
+	VMHandler table[static_cast<int>(VMOpcode::Count)];
+};
+
+struct VMOperand {
+	uint8_t kind;
+	uint8_t reg;
+	uint8_t shift;
+	uint8_t size;
+};
+
+// Register numbers the virtualizer uses for a missing base or index and for RIP relative operands
+constexpr uint8_t VM_REGISTER_NONE = 0xFF;
+constexpr uint8_t VM_REGISTER_RIP = 0xFE;
+
+// Registers of a memory operand, missing ones have their flag cleared and read as zero
+struct VMAddress {
+	uint8_t base;
+	uint8_t index;
+	uint8_t scale;
+	bool hasBase : 1;
+	bool hasIndex : 1;
+};
+
+// A bytecode entry after decryption and parsing, handlers only ever look at this
+struct alignas(16) VMInstruction {
+	VMHandler handler;
+	// Sign extended immediate
+	uint64_t imm;
+	// Memory displacement, already rebased onto the image for RIP relative operands
+	int64_t displacement;
+	VMOperand operands[2];
+	VMAddress address;
+	// Bytecode indices of the following instruction and the branch target
+	uint32_t next;
+	uint32_t target;
+	VMCondition condition;
+	// Opcode of the entry without the mapping of the build
+	uint8_t opcode;
+};
+
+// Number of decoded instructions kept around, the cache is direct mapped on the bytecode index
+#ifndef VM_CACHE_SIZE
+#define VM_CACHE_SIZE 256
+#endif
+
+// Decoded instructions are wiped after this many uses so they do not sit in memory in plain, 0 keeps them
+#ifndef VM_CACHE_WIPE_USES
+#define VM_CACHE_WIPE_USES 0
+#endif
+
+struct alignas(64) VMCacheEntry {
+	// Bytecode index plus one, 0 while the entry is empty
+	uint32_t tag;
+	uint32_t uses;
+	VMInstruction instruction;
+};
+
+struct VMCache {
+	VMCacheEntry entries[VM_CACHE_SIZE];
+};
+
+// Everything an activation writes outside its VMState, every thread gets its own so threads never share a cache line
+struct VMContext {
+	VMCache cache;
+	// Start of the allocation, the slab itself is aligned within it
+	void* memory;
+	// Blob the cache holds entries of, they are keyed on the index alone
+	uint8_t* bytecode;
+};
+
+// Instrumented build that counts executions and rdtsc cycles per opcode and per bytecode index, and how often each
+// opcode follows another, which the protector reads back to pick the pairs it fuses
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
+
+// Threads that get their own counters, further threads run without being counted
+#ifndef VM_PROFILE_THREADS
+#define VM_PROFILE_THREADS 64
+#endif
+
+// Bytecode indices counted per thread, direct mapped like the instruction cache
+#ifndef VM_PROFILE_SITES
+#define VM_PROFILE_SITES 512
+#endif
+
+// The counters are mapped from this file so they end up on disk when the process exits
+#ifndef VM_PROFILE_PATH
+#define VM_PROFILE_PATH "radon-vm.profile"
+#endif
+
+struct VMProfileCounter {
+	uint64_t executions;
+	uint64_t cycles;
+};
+
+struct VMProfileSite {
+	// Bytecode index plus one, 0 while the site is unused
+	uint32_t tag;
+	uint32_t reserved;
+	VMProfileCounter counter;
+};
+
+// Only written by the thread owning it, aligned so threads never share a cache line
+struct alignas(64) VMProfileThread {
+	std::atomic<uint32_t> owner;
+	// Instruction being timed since start
+	uint32_t opcode;
+	uint32_t index;
+	uint32_t timing;
+	uint64_t start;
+	// Executions of indices whose site was taken by another index
+	uint64_t collisions;
+	// Opcode that ran before the current one plus one, 0 at the start of an activation
+	uint32_t previous;
+	uint32_t reserved;
+	VMProfileCounter opcodes[static_cast<int>(VMOpcode::Count)];
+	VMProfileSite sites[VM_PROFILE_SITES];
+	// Executions of an opcode right after another one in the same activation, [previous] [current]
+	// Fused entries count as their two instructions, so the pairs are the same whether the profiled build fuses or not
+	uint64_t pairs[static_cast<int>(VMOpcode::Fused)][static_cast<int>(VMOpcode::Fused)];
+};
+
+// Identifies the file to the protector, which also reads hand written profiles
+constexpr uint32_t VM_PROFILE_MAGIC = 0x504D5652;
+
+// Layout of the profile file, the sizes and offsets in front let a reader parse it without this header
+struct VMProfile {
+	uint32_t magic;
+	uint32_t opcodes;
+	uint32_t sites;
+	uint32_t threads;
+	uint32_t size;
+	// Offsets of the first thread in the file and of the pair counters in every thread
+	uint32_t first;
+	uint32_t pairs;
+	VMProfileThread entries[VM_PROFILE_THREADS];
+};
+
+// Prepared once by the first activation, the handlers only read it afterwards
+struct VMRuntime {
+	// 0 before initialization, 1 while a thread initializes and 2 once everything is ready
+	std::atomic<uint32_t> state;
+	uintptr_t image;
+	// Whether every import resolved, without them there is no thread cache, profile or JIT
+	bool resolved;
+	VMHandlers handlers;
+	// Inverse of the opcode mapping in the header
+	uint8_t opcodes[256];
+	VMProfile* profile;
+	// Thread local slot holding the VMContext of each thread
+	uint32_t context;
+};
+
+// Runs the region starting at the bytecode index, C linkage so entry_sysv.S can call it by its plain name
+extern "C" void VMDispatcher(VMState* state, uint8_t* bytecode, int index);
+
+#ifndef _WIN32
+// System V entry in entry_sysv.S, the call to it is followed by the 8 byte bytecode address and 4 byte index of the region
+extern "C" void VMEnter();
+#endif
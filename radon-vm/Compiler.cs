@@ -39,10 +39,20 @@ namespace radon_vm
 
         private bool _packer;
 
-        public Compiler(string filename, bool packer)
+        // Execution profile the virtualizer picks its fused handlers from
+        private string? _profile;
+
+        private Virtualization.VMFormat _format;
+
+        private Packer.Options _packerOptions;
+
+        public Compiler(string filename, bool packer, string? profile = null, Virtualization.VMFormat format = Virtualization.VMFormat.Variable, Packer.Options? packerOptions = null)
         {
             _filename = filename;
             _packer = packer;
+            _profile = profile;
+            _format = format;
+            _packerOptions = packerOptions ?? new Packer.Options();
 
             _file = PEFile.FromFile(filename);
             _image = PEImage.FromFile(_file);
@@ -54,11 +64,17 @@ namespace radon_vm
 
             _adjustments = new List<Adjustment>();
 
-            PESection inject = new PESection(Util.GenerateSectionName(), SectionFlags.ContentCode | SectionFlags.ContentInitializedData | SectionFlags.MemoryExecute | SectionFlags.MemoryRead,
-                new DataSegment(new byte[InjectHelper.SECTION_SIZE]));
+            // Both injected sections reserve their address space up front, their contents are only known once everything is injected
+            PESection inject = new PESection(Util.GenerateSectionName(), SectionFlags.ContentCode | SectionFlags.MemoryExecute | SectionFlags.MemoryRead,
+                new VirtualSegment(null, (uint)InjectHelper.SECTION_SIZE));
             _file.Sections.Add(inject);
+
+            // Injected runtime globals are written at runtime, they get a section that is writable but not executable
+            PESection data = new PESection(Util.GenerateSectionName(), SectionFlags.ContentInitializedData | SectionFlags.MemoryRead | SectionFlags.MemoryWrite,
+                new VirtualSegment(null, (uint)InjectHelper.SECTION_SIZE));
+            _file.Sections.Add(data);
             _file.UpdateHeaders();
-            _injector = new InjectHelper(this, inject.Rva);
+            _injector = new InjectHelper(this, inject.Rva, data.Rva);
         }
 
         public List<Instruction> GetInstructions(byte[] code, ulong ip)
@@ -146,6 +162,47 @@ namespace radon_vm
             }
         }
 
+        // Reads the functions of the old code section from the exception directory and translates them to the new section
+        public unsafe List<(ulong Begin, ulong End)> GetFunctions(uint newSectionRVA)
+        {
+            var functions = new List<(ulong Begin, ulong End)>();
+
+            var exceptions = _file.OptionalHeader.DataDirectories[(int)DataDirectoryIndex.ExceptionDirectory];
+
+            if (!exceptions.IsPresentInPE)
+            {
+                return functions;
+            }
+
+            var reader = _file.CreateDataDirectoryReader(exceptions);
+
+            int size = sizeof(RUNTIME_FUNCTION);
+
+            long count = exceptions.Size / size;
+
+            for (int i = 0; i < count; i++)
+            {
+                byte[] bytes = new byte[size];
+                reader.ReadBytes(bytes, 0, size);
+
+                fixed (byte* pBytes = bytes)
+                {
+                    var function = *(RUNTIME_FUNCTION*)pBytes;
+
+                    if (!(function.BeginAddress >= _oldCodeSection!.Rva && function.BeginAddress < _oldCodeSection!.Rva + _oldCodeSection!.GetVirtualSize())) continue;
+
+                    uint begin = function.BeginAddress - _oldCodeSection!.Rva;
+                    uint end = function.EndAddress - _oldCodeSection!.Rva;
+
+                    if (_offsets.ContainsKey(begin) && _offsets.ContainsKey(end))
+                    {
+                        functions.Add((newSectionRVA + _offsets[begin], newSectionRVA + _offsets[end]));
+                    }
+                }
+            }
+            return functions;
+        }
+
         public void Insert(int offset, byte[] insertion)
         {
             _adjustments.Add(new Adjustment(offset, insertion));
@@ -448,7 +505,7 @@ namespace radon_vm
 
             if (_packer)
             {
-                Execute(new Virtualization(), oldSectionRVA, newSectionRVA, ref code);
+                Execute(new Virtualization(_profile, _format), oldSectionRVA, newSectionRVA, ref code);
             }
             Execute(new Mutation(), oldSectionRVA, newSectionRVA, ref code);
 
@@ -506,14 +563,17 @@ namespace radon_vm
         public void Save()
         {
             var inject = _file.GetSectionContainingRva(_injector.Rva);
-            inject.Contents = new DataSegment(_injector.Bytes.ToArray());
+            inject.Contents = new VirtualSegment(new DataSegment(_injector.Bytes), (uint)InjectHelper.SECTION_SIZE);
+
+            var data = _file.GetSectionContainingRva(_injector.DataRva);
+            data.Contents = new VirtualSegment(new DataSegment(_injector.DataBytes), (uint)InjectHelper.SECTION_SIZE);
 
             if (_packer)
             {
                 using (var ms = new MemoryStream())
                 {
                     _file.Write(ms);
-                    Packer.Execute(_newCodeSection!.Rva, ms.ToArray(), _filename);
+                    Packer.Execute(_newCodeSection!.Rva, ms.ToArray(), _filename, _packerOptions);
                 }
             }
             else
@@ -8,26 +8,36 @@ namespace radon_vm
 {
     internal class InjectHelper
     {
-        public static int SECTION_SIZE = 0x5000;
+        // Address space every injected section reserves, the file only holds the bytes that are used
+        public static int SECTION_SIZE = 0x100000;
 
         public Dictionary<string, uint> Injected { get { return _injected; } }
-        public byte[] Bytes { get { return _bytes; } }
+        public byte[] Bytes { get { return _bytes[.._offset]; } }
 
         public uint Rva { get { return _rva; } }
 
+        // Globals of the runtime go to their own section, so the handlers never have to be writable
+        public byte[] DataBytes { get { return _data[.._dataOffset]; } }
+        public uint DataRva { get { return _dataRva; } }
+
         private Dictionary<string, uint> _injected;
         private byte[] _bytes;
+        private byte[] _data;
 
         private uint _rva;
         private int _offset;
+        private uint _dataRva;
+        private int _dataOffset;
         private Compiler _compiler;
 
-        public InjectHelper(Compiler compiler, uint rva)
+        public InjectHelper(Compiler compiler, uint rva, uint dataRva)
         {
             _injected = new Dictionary<string, uint>();
-            _bytes = new byte[SECTION_SIZE];
+            _bytes = new byte[0x1000];
+            _data = new byte[0x1000];
             _compiler = compiler;
             _rva = rva;
+            _dataRva = dataRva;
         }
 
         public uint Insert(string name, byte[] data)
@@ -37,6 +47,10 @@ namespace radon_vm
                 return _injected[name];
             }
 
+            // Data is 16 byte aligned for atomic accesses and aligned bytecode loads
+            _offset = (_offset + 15) & ~15;
+
+            Reserve(ref _bytes, _offset, data.Length, name);
             Array.Copy(data, 0, _bytes, _offset, data.Length);
             _injected.Add(name, (uint)(_rva + _offset));
             _offset += data.Length;
@@ -54,6 +68,7 @@ namespace radon_vm
             {
                 ass.Assemble(new StreamCodeWriter(ms), (uint)(_rva + _offset));
                 byte[] assembled = ms.ToArray();
+                Reserve(ref _bytes, _offset, assembled.Length, name);
                 Array.Copy(assembled, 0, _bytes, _offset, assembled.Length);
                 _injected.Add(name, (uint)(_rva + _offset));
                 _offset += assembled.Length;
@@ -61,11 +76,46 @@ namespace radon_vm
             }
         }
 
+        // Grows the buffer for length bytes at the offset, the rvas after the section are fixed so it can not outgrow SECTION_SIZE
+        private static void Reserve(ref byte[] buffer, int offset, int length, string name)
+        {
+            if (offset + length > SECTION_SIZE)
+            {
+                throw new Exception(string.Format("Injecting {0} needs 0x{1:X} bytes, the section only reserves 0x{2:X}", name, offset + length, SECTION_SIZE));
+            }
+
+            if (offset + length > buffer.Length)
+            {
+                Array.Resize(ref buffer, Math.Min(Math.Max(buffer.Length * 2, offset + length), SECTION_SIZE));
+            }
+        }
+
         public int OffsetOf(string name)
         {
             return (int)(_injected[name] - _rva);
         }
 
+        // Copies a global of the runtime into the data section, it starts out with the value the runtime was loaded with
+        public uint InjectData(string name)
+        {
+            if (_injected.ContainsKey(name))
+            {
+                return _injected[name];
+            }
+
+            byte[] data = new byte[Runtime.GetSize(name)];
+            Marshal.Copy(Runtime.GetFunction(name), data, 0, data.Length);
+
+            // Aligned like inserted data for the atomics among the globals
+            _dataOffset = (_dataOffset + 15) & ~15;
+
+            Reserve(ref _data, _dataOffset, data.Length, name);
+            Array.Copy(data, 0, _data, _dataOffset, data.Length);
+            _injected.Add(name, (uint)(_dataRva + _dataOffset));
+            _dataOffset += data.Length;
+            return _injected[name];
+        }
+
         public unsafe uint Inject(string name)
         {
             if (_injected.ContainsKey(name))
@@ -100,7 +150,8 @@ namespace radon_vm
                 {
                     ulong target = instr.IsIPRelativeMemoryOperand ? instr.IPRelativeMemoryAddress : instr.NearBranchTarget;
 
-                    if (!(target >= start && target < end))
+                    // Rva 0 is __ImageBase of the runtime, kept as is it becomes the base of the protected image
+                    if (target != 0 && !(target >= start && target < end))
                     {
                         bool isInSameSection = target >= section.Rva && target < section.Rva + section.GetVirtualSize();
 
@@ -112,7 +163,10 @@ namespace radon_vm
                         } 
                         else
                         {
-                            throw new NotImplementedException();
+                            var data = Runtime.GetSymbol(target);
+                            ulong begin = data.Address - data.ModBase;
+                            Console.WriteLine("Injecting: {0}", data.Name);
+                            _compiler.SetTarget(ref instr, InjectData(data.Name) + (target - begin));
                         }
                     }
                 }
@@ -132,6 +186,7 @@ namespace radon_vm
             // Obfuscate
             _compiler.Obfuscate(ref body, (uint)(_rva + _offset));
 
+            Reserve(ref _bytes, _offset, body.Length, name);
             Array.Copy(body, 0, _bytes, _offset, body.Length);
 
             _injected.Add(name, (uint)(_rva + _offset));
@@ -1,10 +1,50 @@
-﻿namespace radon_vm
+﻿using radon_vm.Protections;
+
+namespace radon_vm
 {
     internal class Program
     {
         private static void Main(string[] args)
         {
             string inputPath = args[0];
+            string? profilePath = null;
+            var format = Virtualization.VMFormat.Variable;
+            var packerOptions = new Packer.Options();
+
+            // radon-vm <input> [--profile <path>] [--format variable|fixed|compact] [--working-set <blocks>]
+            //     [--hot-threshold <traps>] [--packer-profile <path>] [--record-profile true|false]
+            //     [--trap-mode block|page]
+            for (int i = 1; i + 1 < args.Length; i += 2)
+            {
+                if (args[i] == "--profile")
+                {
+                    profilePath = args[i + 1];
+                }
+                else if (args[i] == "--format")
+                {
+                    format = Enum.Parse<Virtualization.VMFormat>(args[i + 1], true);
+                }
+                else if (args[i] == "--working-set")
+                {
+                    packerOptions.WorkingSet = Math.Max(1, int.Parse(args[i + 1]));
+                }
+                else if (args[i] == "--hot-threshold")
+                {
+                    packerOptions.HotThreshold = ulong.Parse(args[i + 1]);
+                }
+                else if (args[i] == "--packer-profile")
+                {
+                    packerOptions.Profile = args[i + 1];
+                }
+                else if (args[i] == "--record-profile")
+                {
+                    packerOptions.RecordProfile = bool.Parse(args[i + 1]);
+                }
+                else if (args[i] == "--trap-mode")
+                {
+                    packerOptions.TrapMode = Enum.Parse<Packer.TrapMode>(args[i + 1], true);
+                }
+            }
             string? inputDir = Path.GetDirectoryName(inputPath);
 
             if (string.IsNullOrEmpty(inputDir))
@@ -19,7 +59,7 @@
 
             File.Copy(inputPath, outputPath, true);
 
-            Compiler compiler = new Compiler(outputPath, true);
+            Compiler compiler = new Compiler(outputPath, true, profilePath, format, packerOptions);
             compiler.Protect();
             compiler.Save();
         }
@@ -15,16 +15,44 @@ namespace radon_vm.Protections
         private const string RUNTIME = "radon-vm.runtime.packer.exe";
         private const int KEY_SIZE = 32;
 
-        public static void Execute(uint rva, byte[] binary, string filename)
+        // How the child traps into encrypted code, on the 0xCC filling every instruction or on executing a page that is not executable
+        internal enum TrapMode : ulong
+        {
+            Block,
+            Page
+        }
+
+        // Settings of the packer runtime, fixed when the binary is packed
+        internal class Options
+        {
+            // Blocks every thread keeps decrypted at once, the least recently trapped one is encrypted again first
+            // In page mode it is the number of pages the whole process keeps decrypted and executable, at least two
+            public int WorkingSet { get; set; } = 4;
+
+            public TrapMode TrapMode { get; set; } = TrapMode.Block;
+
+            // Traps after which a block stays decrypted for the rest of the run, 0 never promotes a block
+            public ulong HotThreshold { get; set; } = 1000;
+
+            // Whether the packed binary writes its trap profile next to itself on exit, only meant for profiling builds since
+            // the profile gives away where the hot code of the target is
+            public bool RecordProfile { get; set; }
+
+            // Trap profile the packer runtime wrote on an earlier run, blocks past the threshold in it are not encrypted at all
+            public string? Profile { get; set; }
+        }
+
+        public static void Execute(uint rva, byte[] binary, string filename, Options options)
         {
             var src = PEFile.FromBytes(binary);
 
-            var runtime = new Runtime();
+            var runtime = new Runtime((ulong)options.WorkingSet, options.HotThreshold, options.RecordProfile, options.TrapMode);
             var target = src.GetSectionContainingRva(rva);
             byte[] code = target.WriteIntoArray();
 
             var reader = new ByteArrayCodeReader(code);
             var decoder = Decoder.Create(64, reader, target.Rva);
+            var instrs = new List<Instruction>();
 
             while (reader.CanReadByte)
             {
@@ -32,6 +60,27 @@ namespace radon_vm.Protections
 
                 if (!instr.IsInvalid && instr.Mnemonic != Mnemonic.Int3)
                 {
+                    instrs.Add(instr);
+                }
+            }
+
+            var hot = options.Profile != null ? LoadProfile(options.Profile, options.HotThreshold) : new HashSet<ulong>();
+            var blocks = GetBlocks(instrs).Where(x => !hot.Contains(x.Start)).ToList();
+            var starts = blocks.Select(x => x.Start).ToHashSet();
+            var last = instrs.ToDictionary(x => x.NextIP);
+            int next = 0;
+
+            // Blocks and instructions are both in address order, so one pass hands every block its instructions
+            foreach (var (start, end) in blocks)
+            {
+                while (instrs[next].IP < start)
+                {
+                    next++;
+                }
+
+                for (; next < instrs.Count && instrs[next].IP < end; next++)
+                {
+                    var instr = instrs[next];
                     int offset = (int)(instr.IP - target.Rva);
                     byte[] raw = code.Skip(offset).Take(instr.Length).ToArray();
 
@@ -41,6 +90,8 @@ namespace radon_vm.Protections
 
                     Array.Fill(code, (byte)0xCC, offset, instr.Length);
                 }
+
+                runtime.AddBlock(start, end, GetSuccessors(last[end], starts));
             }
 
             target!.Contents = new DataSegment(code);
@@ -71,10 +122,96 @@ namespace radon_vm.Protections
             }
         }
 
+        // Splits the encrypted instructions into blocks that are only entered at the top. A block ends after every instruction
+        // that does not fall through, before every branch target and wherever an instruction was left as it is
+        private static List<(ulong Start, ulong End)> GetBlocks(List<Instruction> instrs)
+        {
+            var targets = instrs.Where(x => x.FlowControl != FlowControl.Next && x.Op0Kind == OpKind.NearBranch64)
+                .Select(x => x.NearBranchTarget)
+                .ToHashSet();
+
+            var blocks = new List<(ulong, ulong)>();
+
+            for (int i = 0; i < instrs.Count; i++)
+            {
+                var instr = instrs[i];
+
+                if (i == 0 || instrs[i - 1].NextIP != instr.IP || instrs[i - 1].FlowControl != FlowControl.Next || targets.Contains(instr.IP))
+                {
+                    blocks.Add((instr.IP, instr.NextIP));
+                }
+                else
+                {
+                    blocks[^1] = (blocks[^1].Item1, instr.NextIP);
+                }
+            }
+            return blocks;
+        }
+
+        // Every line of the profile is the rva of a block in hex followed by how often it trapped, e.g. "1A40 5312"
+        private static HashSet<ulong> LoadProfile(string path, ulong threshold)
+        {
+            var hot = new HashSet<ulong>();
+
+            if (threshold == 0)
+            {
+                return hot;
+            }
+
+            foreach (string line in File.ReadLines(path))
+            {
+                string[] parts = line.Split(' ', StringSplitOptions.RemoveEmptyEntries);
+
+                if (parts.Length < 2 || parts[0].StartsWith("#"))
+                {
+                    continue;
+                }
+
+                ulong rva = Convert.ToUInt64(parts[0], 16);
+                ulong count = ulong.Parse(parts[1]);
+
+                if (count >= threshold)
+                {
+                    Console.WriteLine("Leaving hot block {0:X} unencrypted ({1} traps)", rva, count);
+                    hot.Add(rva);
+                }
+            }
+            return hot;
+        }
+
+        // Blocks the last instruction of a block can continue at, the fall-through first since it is the more likely one
+        private static List<ulong> GetSuccessors(Instruction last, HashSet<ulong> starts)
+        {
+            var successors = new List<ulong>();
+
+            if (last.FlowControl is FlowControl.Next or FlowControl.ConditionalBranch or FlowControl.Call or FlowControl.IndirectCall)
+            {
+                successors.Add(last.NextIP);
+            }
+
+            if ((last.FlowControl is FlowControl.ConditionalBranch or FlowControl.UnconditionalBranch or FlowControl.Call) && last.Op0Kind == OpKind.NearBranch64)
+            {
+                successors.Add(last.NearBranchTarget);
+            }
+            return successors.Where(starts.Contains).Distinct().ToList();
+        }
+
         internal class Runtime
         {
             private Dictionary<ulong, RuntimeInstruction> _runtimeInstrs = new Dictionary<ulong, RuntimeInstruction>();
-            private ulong _oldRVA = 0;
+            private List<(ulong Start, ulong End, List<ulong> Successors)> _blocks = new List<(ulong, ulong, List<ulong>)>();
+            private ulong _workingSet;
+            private ulong _hotThreshold;
+            private bool _recordProfile;
+            private TrapMode _trapMode;
+
+            public Runtime(ulong workingSet, ulong hotThreshold, bool recordProfile, TrapMode trapMode)
+            {
+                _workingSet = workingSet;
+                _hotThreshold = hotThreshold;
+                _recordProfile = recordProfile;
+                _trapMode = trapMode;
+            }
 
             public byte[] Serialize()
             {
@@ -99,9 +236,27 @@ namespace radon_vm.Protections
                     serialized.AddRange(keyBytes);
                 }
 
-                ulong oldRVASize = sizeof(ulong);
-                serialized.AddRange(BitConverter.GetBytes(oldRVASize));
-                serialized.AddRange(BitConverter.GetBytes(_oldRVA));
+                serialized.AddRange(BitConverter.GetBytes(_workingSet));
+                serialized.AddRange(BitConverter.GetBytes(_hotThreshold));
+                serialized.AddRange(BitConverter.GetBytes(_recordProfile ? 1UL : 0UL));
+                serialized.AddRange(BitConverter.GetBytes((ulong)_trapMode));
+
+                ulong blockCount = (ulong)_blocks.Count;
+                serialized.AddRange(BitConverter.GetBytes(blockCount));
+
+                foreach (var (start, end, successors) in _blocks)
+                {
+                    serialized.AddRange(BitConverter.GetBytes(start));
+                    serialized.AddRange(BitConverter.GetBytes(end));
+
+                    ulong successorCount = (ulong)successors.Count;
+                    serialized.AddRange(BitConverter.GetBytes(successorCount));
+
+                    foreach (ulong successor in successors)
+                    {
+                        serialized.AddRange(BitConverter.GetBytes(successor));
+                    }
+                }
 
                 return serialized.ToArray();
             }
@@ -111,6 +266,11 @@ namespace radon_vm.Protections
                 _runtimeInstrs.Add(rva, runtimeInstr);
             }
 
+            public void AddBlock(ulong start, ulong end, List<ulong> successors)
+            {
+                _blocks.Add((start, end, successors));
+            }
+
             public bool HasInstruction(ulong rva)
             {
                 return _runtimeInstrs.ContainsKey(rva);
@@ -121,21 +281,6 @@ namespace radon_vm.Protections
                 return _runtimeInstrs[rva];
             }
 
-            public ulong GetOldRVA()
-            {
-                if (_oldRVA != 0)
-                {
-                    ulong oldRVA = _oldRVA;
-                    _oldRVA = 0;
-                    return oldRVA;
-                }
-                return 0;
-            }
-
-            public void SetOldRVA(ulong rva)
-            {
-                _oldRVA = rva;
-            }
         }
 
         internal class RuntimeInstruction
@@ -1,6 +1,7 @@
 ﻿using Iced.Intel;
 using System;
 using System.Diagnostics;
+using System.Numerics;
 using static Iced.Intel.AssemblerRegisters;
 
 namespace radon_vm.Protections
@@ -34,6 +35,150 @@ namespace radon_vm.Protections
             None
         }
 
+        enum MathOperation
+        {
+            Add,
+            Sub,
+            Cmp,
+            Mov,
+            Count
+        }
+
+        enum VMShape
+        {
+            RegisterRegister,
+            RegisterMemory,
+            RegisterImmediate,
+            MemoryRegister,
+            MemoryImmediate,
+            Count
+        }
+
+        public enum VMFormat
+        {
+            Variable,
+            Fixed,
+            Compact
+        }
+
+        enum VMFixedKind
+        {
+            None,
+            Register,
+            Memory,
+            Immediate,
+            Branch
+        }
+
+        enum VMCompactKind
+        {
+            None,
+            Register,
+            Memory,
+            Immediate
+        }
+
+        enum VMOpcode
+        {
+            Exit,
+            Jmp,
+            Jcc,
+            Ret,
+            Math,
+            Fused = Math + (int)MathOperation.Count * (int)VMShape.Count * 4,
+            Count = Fused + 12
+        }
+
+        // Opcode pairs the runtime has a fused handler for, same order as VMFusions
+        private static readonly (int First, int Second)[] Fusions =
+        {
+            (MathOpcode(MathOperation.Cmp, VMShape.RegisterRegister, 4), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Cmp, VMShape.RegisterRegister, 8), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Cmp, VMShape.RegisterImmediate, 4), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Cmp, VMShape.RegisterImmediate, 8), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Sub, VMShape.RegisterImmediate, 4), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Sub, VMShape.RegisterImmediate, 8), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Add, VMShape.RegisterImmediate, 4), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Add, VMShape.RegisterImmediate, 8), (int)VMOpcode.Jcc),
+            (MathOpcode(MathOperation.Mov, VMShape.RegisterRegister, 4), MathOpcode(MathOperation.Add, VMShape.RegisterRegister, 4)),
+            (MathOpcode(MathOperation.Mov, VMShape.RegisterRegister, 8), MathOpcode(MathOperation.Add, VMShape.RegisterRegister, 8)),
+            (MathOpcode(MathOperation.Mov, VMShape.RegisterRegister, 4), MathOpcode(MathOperation.Add, VMShape.RegisterImmediate, 4)),
+            (MathOpcode(MathOperation.Mov, VMShape.RegisterRegister, 8), MathOpcode(MathOperation.Add, VMShape.RegisterImmediate, 8)),
+        };
+
+        private static Random _rand = new Random();
+
+        // Maps every VMOpcode to the byte used for it in this build
+        private byte[] _opcodes = Array.Empty<byte>();
+
+        // Bytecode index of every virtualized instruction so branches can be resolved inside the VM
+        private Dictionary<ulong, int> _targets = new Dictionary<ulong, int>();
+
+        // Register numbers for a missing base or index and for RIP relative operands, same as the runtime
+        private const byte REGISTER_NONE = 0xFF;
+        private const byte REGISTER_RIP = 0xFE;
+
+        // Layout of the bytecode header, same as the runtime
+        private const int FIXED_SIZE = 16;
+        private const int HEADER_FORMAT = (int)VMOpcode.Count;
+        private const int HEADER_POOL = (HEADER_FORMAT + 1 + 3) & ~3;
+        private const int HEADER_SIZE = (HEADER_POOL + 4 + FIXED_SIZE - 1) & ~(FIXED_SIZE - 1);
+
+        // Start of the profile a VM_PROFILE build of the runtime records, same as VMProfile
+        private const uint PROFILE_MAGIC = 0x504D5652;
+        private const int HEADER_PROFILE = 28;
+
+        private VMFormat _format;
+
+        // Immediates of the fixed format that do not fit in an entry
+        private List<ulong> _pool = new List<ulong>();
+
+        private const byte COMPACT_BRANCH = 0x40;
+        private const byte COMPACT_INLINE = 0xFF;
+
+        // Memory operand registers of the compact format shared by every entry using them
+        private Dictionary<(byte Base, byte Index, byte Scale), byte> _descriptors = new Dictionary<(byte, byte, byte), byte>();
+
+        // RVA range of the code section being virtualized
+        private (ulong Begin, ulong End) _code;
+
+        // Fused opcode of every pair the execution profile asked for
+        private Dictionary<(int, int), int> _fusions = new Dictionary<(int, int), int>();
+
+        // Layout of the VMState built by the entry stubs, same as the runtime
+        private const int STATE_SIZE = 256;
+        private const int STATE_RFLAGS = 128;
+        private const int STATE_RIP = 136;
+
+        // Physical register of every VMRegister
+        private static readonly AssemblerRegister64[] StateRegisters =
+        {
+            rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15
+        };
+
+        // Registers VMDispatcher may clobber, everything else is preserved by the calling convention
+        private static readonly VMRegister[] VolatileRegisters =
+        {
+            VMRegister.RAX, VMRegister.RCX, VMRegister.RDX, VMRegister.R8, VMRegister.R9, VMRegister.R10, VMRegister.R11
+        };
+
+        private const RflagsBits STATUS_FLAGS = RflagsBits.CF | RflagsBits.PF | RflagsBits.AF | RflagsBits.ZF | RflagsBits.SF | RflagsBits.OF;
+
+        // Number of native instructions after a region that are scanned for reads of its registers and flags
+        private const int LIVENESS_WINDOW = 64;
+
+        private static InstructionInfoFactory _info = new InstructionInfoFactory();
+
+        public Virtualization(string? profile, VMFormat format)
+        {
+            _format = format;
+
+            if (profile != null)
+            {
+                LoadProfile(profile);
+            }
+        }
+
         private VMRegister ToVMRegister(Register reg)
         {
             switch (reg)
@@ -224,10 +369,227 @@ namespace radon_vm.Protections
             }
         }
 
-        private byte[] Convert(int index, Instruction instr)
+        private VMOpcode ToVMOpcode(Instruction instr)
+        {
+            if (instr.IsJccShortOrNear)
+            {
+                return VMOpcode.Jcc;
+            }
+
+            switch (instr.Mnemonic)
+            {
+                case Mnemonic.Add:
+                    return VMOpcode.Math;
+                case Mnemonic.Sub:
+                    return VMOpcode.Math;
+                case Mnemonic.Cmp:
+                    return VMOpcode.Math;
+                case Mnemonic.Mov:
+                    return VMOpcode.Math;
+                case Mnemonic.Jmp:
+                    return VMOpcode.Jmp;
+                case Mnemonic.Ret:
+                    return VMOpcode.Ret;
+
+                default:
+                    throw new NotImplementedException();
+            }
+        }
+
+        private MathOperation ToMathOperation(Instruction instr)
+        {
+            switch (instr.Mnemonic)
+            {
+                case Mnemonic.Add:
+                    return MathOperation.Add;
+                case Mnemonic.Sub:
+                    return MathOperation.Sub;
+                case Mnemonic.Cmp:
+                    return MathOperation.Cmp;
+                case Mnemonic.Mov:
+                    return MathOperation.Mov;
+
+                default:
+                    throw new NotImplementedException();
+            }
+        }
+
+        private VMShape GetShape(Instruction instr)
+        {
+            bool memory = instr.Op0Kind == OpKind.Memory;
+
+            if (instr.Op1Kind == OpKind.Register)
+            {
+                return memory ? VMShape.MemoryRegister : VMShape.RegisterRegister;
+            }
+            else if (instr.Op1Kind == OpKind.Memory)
+            {
+                return VMShape.RegisterMemory;
+            }
+            return memory ? VMShape.MemoryImmediate : VMShape.RegisterImmediate;
+        }
+
+        // Math handlers are specialized on operation, shape and size, numbered [operation] [shape] [size]
+        private static int MathOpcode(MathOperation operation, VMShape shape, int size)
+        {
+            int variant = (int)operation * (int)VMShape.Count + (int)shape;
+            return (int)VMOpcode.Math + variant * 4 + BitOperations.Log2((uint)size);
+        }
+
+        private int GetOpcode(Instruction instr)
+        {
+            VMOpcode opcode = ToVMOpcode(instr);
+
+            if (opcode != VMOpcode.Math)
+            {
+                return (int)opcode;
+            }
+
+            int size = instr.Op0Kind == OpKind.Memory ? instr.MemorySize.GetSize() : instr.Op0Register.GetSize();
+            return MathOpcode(ToMathOperation(instr), GetShape(instr), size);
+        }
+
+        // Names opcodes the way profiles refer to them, Jcc for plain opcodes and Cmp.RegisterImmediate.4 for math
+        private static int ParseOpcode(string name)
+        {
+            string[] parts = name.Split('.');
+
+            if (parts.Length == 1)
+            {
+                return (int)Enum.Parse<VMOpcode>(parts[0]);
+            }
+            return MathOpcode(Enum.Parse<MathOperation>(parts[0]), Enum.Parse<VMShape>(parts[1]), int.Parse(parts[2]));
+        }
+
+        // Every line of a written profile is an executed opcode sequence followed by its count, e.g. "Cmp.RegisterImmediate.4 Jcc 1200"
+        private static Dictionary<(int, int), long> ReadPairs(string path)
+        {
+            var counts = new Dictionary<(int, int), long>();
+
+            foreach (string line in File.ReadLines(path))
+            {
+                string[] parts = line.Split(' ', StringSplitOptions.RemoveEmptyEntries);
+
+                if (parts.Length < 3 || parts[0].StartsWith("#"))
+                {
+                    continue;
+                }
+
+                long count = long.Parse(parts[^1]);
+
+                // Triples and longer sequences count towards every pair they contain
+                for (int i = 0; i + 2 < parts.Length; i++)
+                {
+                    var pair = (ParseOpcode(parts[i]), ParseOpcode(parts[i + 1]));
+                    counts[pair] = counts.GetValueOrDefault(pair) + count;
+                }
+            }
+            return counts;
+        }
+
+        // Sums the pair counters of every thread in the file a VM_PROFILE build of the runtime maps, see VMProfile
+        // The header is [magic] [opcodes] [sites] [threads] [thread size] [offset of the first thread] [offset of the pairs]
+        private static Dictionary<(int, int), long> ReadRecordedPairs(byte[] profile)
+        {
+            if (BitConverter.ToInt32(profile, 4) != (int)VMOpcode.Count)
+            {
+                throw new Exception("The profile was recorded by a runtime with different opcodes");
+            }
+
+            int threads = BitConverter.ToInt32(profile, 12);
+            int size = BitConverter.ToInt32(profile, 16);
+            int first = BitConverter.ToInt32(profile, 20);
+            int pairs = BitConverter.ToInt32(profile, 24);
+
+            // Fused opcodes are recorded as their two instructions, so only the plain opcodes have pair counters
+            int opcodes = (int)VMOpcode.Fused;
+            var counts = new Dictionary<(int, int), long>();
+
+            for (int thread = 0; thread < threads; thread++)
+            {
+                for (int previous = 0; previous < opcodes; previous++)
+                {
+                    for (int current = 0; current < opcodes; current++)
+                    {
+                        long count = BitConverter.ToInt64(profile, first + thread * size + pairs + (previous * opcodes + current) * sizeof(long));
+
+                        if (count != 0)
+                        {
+                            counts[(previous, current)] = counts.GetValueOrDefault((previous, current)) + count;
+                        }
+                    }
+                }
+            }
+            return counts;
+        }
+
+        // Takes either a profile written by hand or the one a VM_PROFILE build of the runtime records while it runs
+        private void LoadProfile(string path)
+        {
+            byte[] profile = File.ReadAllBytes(path);
+
+            var counts = profile.Length >= HEADER_PROFILE && BitConverter.ToUInt32(profile, 0) == PROFILE_MAGIC ? ReadRecordedPairs(profile) : ReadPairs(path);
+
+            foreach (var fusion in Fusions.OrderByDescending(x => counts.GetValueOrDefault(x)))
+            {
+                if (counts.GetValueOrDefault(fusion) == 0)
+                {
+                    break;
+                }
+
+                Console.WriteLine("Fusing: {0:X} {1:X} ({2} times)", fusion.First, fusion.Second, counts[fusion]);
+                _fusions[fusion] = (int)VMOpcode.Fused + Array.IndexOf(Fusions, fusion);
+            }
+        }
+
+        // The opcode mapping is stored in front of the bytecode so the dispatcher can build its handler table
+        // It is followed by the format and the offset of the constant pool, aligned so fixed entries are too
+        private byte[] GetHeader()
+        {
+            byte[] header = new byte[HEADER_SIZE];
+            _opcodes.CopyTo(header, 0);
+            header[HEADER_FORMAT] = (byte)_format;
+            return header;
+        }
+
+        private byte[] ShuffleOpcodes()
+        {
+            return Enumerable.Range(0, (int)VMOpcode.Count)
+                .Select(x => (byte)x)
+                .OrderBy(x => _rand.Next())
+                .ToArray();
+        }
+
+        private byte GetOpcodeByte(Instruction instr, Instruction? next)
+        {
+            int opcode = GetOpcode(instr);
+
+            // A fused pair replaces the opcode of its first instruction, the second one keeps its entry
+            if (next.HasValue && _fusions.TryGetValue((opcode, GetOpcode(next.Value)), out int fused))
+            {
+                opcode = fused;
+            }
+            return _opcodes[opcode];
+        }
+
+        private byte GetMemoryRegister(Register reg)
         {
+            return reg == Register.None ? REGISTER_NONE : (byte)ToVMRegister(reg);
+        }
+
+        private byte[] Convert(int index, Instruction instr, Instruction? next)
+        {
+            if (_format == VMFormat.Fixed)
+            {
+                return ConvertFixed(instr, next);
+            }
+            else if (_format == VMFormat.Compact)
+            {
+                return ConvertCompact(instr, next);
+            }
+
             var bytes = new List<byte>();
-            bytes.AddRange(BitConverter.GetBytes((short)instr.Mnemonic));
+            bytes.Add(GetOpcodeByte(instr, next));
             bytes.Add((byte)instr.OpCount);
 
             for (int i = 0; i < instr.OpCount; i++)
@@ -251,10 +613,29 @@ namespace radon_vm.Protections
                 }
                 else if (kind == OpKind.Memory)
                 {
-                    Register reg = instr.MemoryBase;
-                    bytes.Add((byte)reg.GetSize());
-                    bytes.Add((byte)ToVMRegister(reg));
-                    bytes.Add((byte)GetRegisterPart(reg));
+                    // [base] [index] [scale] [displacement] where RIP relative operands store the RVA of their target
+                    bytes.Add((byte)instr.MemorySize.GetSize());
+
+                    if (instr.IsIPRelativeMemoryOperand)
+                    {
+                        bytes.Add(REGISTER_RIP);
+                        bytes.Add(REGISTER_NONE);
+                        bytes.Add(0);
+                        bytes.AddRange(BitConverter.GetBytes((uint)instr.IPRelativeMemoryAddress));
+                    }
+                    else
+                    {
+                        bytes.Add(GetMemoryRegister(instr.MemoryBase));
+                        bytes.Add(GetMemoryRegister(instr.MemoryIndex));
+                        bytes.Add((byte)BitOperations.Log2((uint)instr.MemoryIndexScale));
+                        bytes.AddRange(BitConverter.GetBytes((int)instr.MemoryDisplacement64));
+                    }
+                }
+                else if (kind == OpKind.NearBranch64)
+                {
+                    // Branches continue at the bytecode index of their target which is always part of the same region
+                    bytes.Add((byte)instr.ConditionCode);
+                    bytes.AddRange(BitConverter.GetBytes(_targets.GetValueOrDefault(instr.NearBranchTarget)));
                 }
                 else
                 {
@@ -264,6 +645,167 @@ namespace radon_vm.Protections
             return bytes.ToArray();
         }
 
+        // 16 byte entry, the first word holds [opcode] [kinds] [register 0] [register 1] [base] [index] [scale or condition] [flags]
+        // and the second [displacement or target] [immediate or pool slot]
+        private byte[] ConvertFixed(Instruction instr, Instruction? next)
+        {
+            byte[] entry = new byte[FIXED_SIZE];
+            entry[0] = GetOpcodeByte(instr, next);
+
+            for (int i = 0; i < instr.OpCount; i++)
+            {
+                OpKind kind = instr.GetOpKind(i);
+
+                if (kind == OpKind.Register)
+                {
+                    Register reg = instr.GetOpRegister(i);
+                    entry[1] |= (byte)((int)VMFixedKind.Register << (i * 4));
+                    entry[2 + i] = (byte)((int)ToVMRegister(reg) | (GetRegisterPart(reg) == VMRegisterPart.Higher ? 16 : 0));
+                }
+                else if (kind.IsImmediate())
+                {
+                    long imm = (long)instr.GetImmediate(i);
+                    entry[1] |= (byte)((int)VMFixedKind.Immediate << (i * 4));
+
+                    // Spill immediates that do not fit in 32 bits to the constant pool
+                    if (imm < int.MinValue || imm > int.MaxValue)
+                    {
+                        entry[7] |= 1;
+                        BitConverter.GetBytes(_pool.Count).CopyTo(entry, 12);
+                        _pool.Add((ulong)imm);
+                    }
+                    else
+                    {
+                        BitConverter.GetBytes((int)imm).CopyTo(entry, 12);
+                    }
+                }
+                else if (kind == OpKind.Memory)
+                {
+                    entry[1] |= (byte)((int)VMFixedKind.Memory << (i * 4));
+
+                    if (instr.IsIPRelativeMemoryOperand)
+                    {
+                        entry[4] = REGISTER_RIP;
+                        entry[5] = REGISTER_NONE;
+                        BitConverter.GetBytes((uint)instr.IPRelativeMemoryAddress).CopyTo(entry, 8);
+                    }
+                    else
+                    {
+                        entry[4] = GetMemoryRegister(instr.MemoryBase);
+                        entry[5] = GetMemoryRegister(instr.MemoryIndex);
+                        entry[6] = (byte)BitOperations.Log2((uint)instr.MemoryIndexScale);
+                        BitConverter.GetBytes((int)instr.MemoryDisplacement64).CopyTo(entry, 8);
+                    }
+                }
+                else if (kind == OpKind.NearBranch64)
+                {
+                    entry[1] |= (byte)((int)VMFixedKind.Branch << (i * 4));
+                    entry[6] = (byte)instr.ConditionCode;
+                    BitConverter.GetBytes(_targets.GetValueOrDefault(instr.NearBranchTarget)).CopyTo(entry, 8);
+                }
+                else
+                {
+                    throw new NotImplementedException();
+                }
+            }
+            return entry;
+        }
+
+        private static void AddVarint(List<byte> bytes, ulong value)
+        {
+            do
+            {
+                byte b = (byte)(value & 0x7F);
+                value >>= 7;
+                bytes.Add(value != 0 ? (byte)(b | 0x80) : b);
+            }
+            while (value != 0);
+        }
+
+        private static ulong ZigZag(long value)
+        {
+            return (ulong)(value << 1) ^ (ulong)(value >> 63);
+        }
+
+        // [opcode] [kinds] followed by [register 1 | register 0] when there is a register, [descriptor] [displacement]
+        // for memory, an immediate or [condition] [target] for a branch, numbers are varints
+        private byte[] ConvertCompact(Instruction instr, Instruction? next)
+        {
+            var bytes = new List<byte>();
+            bytes.Add(GetOpcodeByte(instr, next));
+
+            byte kinds = 0;
+            byte registers = 0;
+            bool hasRegister = false;
+            var operands = new List<byte>();
+
+            for (int i = 0; i < instr.OpCount; i++)
+            {
+                OpKind kind = instr.GetOpKind(i);
+
+                if (kind == OpKind.Register)
+                {
+                    Register reg = instr.GetOpRegister(i);
+                    kinds |= (byte)((int)VMCompactKind.Register << (i * 2));
+                    kinds |= (byte)(GetRegisterPart(reg) == VMRegisterPart.Higher ? 1 << (4 + i) : 0);
+                    registers |= (byte)((int)ToVMRegister(reg) << (i * 4));
+                    hasRegister = true;
+                }
+                else if (kind.IsImmediate())
+                {
+                    kinds |= (byte)((int)VMCompactKind.Immediate << (i * 2));
+                    AddVarint(operands, ZigZag((long)instr.GetImmediate(i)));
+                }
+                else if (kind == OpKind.Memory)
+                {
+                    kinds |= (byte)((int)VMCompactKind.Memory << (i * 2));
+
+                    var descriptor = instr.IsIPRelativeMemoryOperand ?
+                        (REGISTER_RIP, REGISTER_NONE, (byte)0) :
+                        (GetMemoryRegister(instr.MemoryBase), GetMemoryRegister(instr.MemoryIndex), (byte)BitOperations.Log2((uint)instr.MemoryIndexScale));
+
+                    if (!_descriptors.ContainsKey(descriptor) && _descriptors.Count < COMPACT_INLINE)
+                    {
+                        _descriptors.Add(descriptor, (byte)_descriptors.Count);
+                    }
+
+                    // Only the first 255 distinct descriptors are shared, the rest are stored with the entry
+                    if (_descriptors.TryGetValue(descriptor, out byte shared))
+                    {
+                        operands.Add(shared);
+                    }
+                    else
+                    {
+                        operands.Add(COMPACT_INLINE);
+                        operands.AddRange(new byte[] { descriptor.Item1, descriptor.Item2, descriptor.Item3 });
+                    }
+
+                    long displacement = instr.IsIPRelativeMemoryOperand ? (long)(uint)instr.IPRelativeMemoryAddress : (int)instr.MemoryDisplacement64;
+                    AddVarint(operands, ZigZag(displacement));
+                }
+                else if (kind == OpKind.NearBranch64)
+                {
+                    kinds |= (byte)((int)VMCompactKind.Immediate << (i * 2) | COMPACT_BRANCH);
+                    operands.Add((byte)instr.ConditionCode);
+                    AddVarint(operands, (ulong)_targets.GetValueOrDefault(instr.NearBranchTarget));
+                }
+                else
+                {
+                    throw new NotImplementedException();
+                }
+            }
+
+            bytes.Add(kinds);
+
+            if (hasRegister)
+            {
+                bytes.Add(registers);
+            }
+
+            bytes.AddRange(operands);
+            return bytes.ToArray();
+        }
+
         public static byte[] Crypt(byte[] bytes, int key)
         {
             byte[] encrypted = new byte[bytes.Length];
@@ -275,89 +817,534 @@ namespace radon_vm.Protections
             return encrypted;
         }
 
-        private void Virtualize(Compiler compiler, Instruction instr, uint oldSectionRVA, uint newSectionRVA, int offset, int index, uint bytecode, uint entry, uint dispatcher, uint exit)
+        // Encrypts a single bytecode entry and prefixes it with its length [length] [opcode] [operands]
+        // Fixed entries are padded to their width instead and keyed on their entry number
+        private byte[] Encode(int index, byte[] bytes)
+        {
+            if (_format == VMFormat.Fixed)
+            {
+                byte[] entry = new byte[FIXED_SIZE];
+                bytes.CopyTo(entry, 0);
+                return Crypt(entry, index >> 4);
+            }
+            else if (_format == VMFormat.Compact)
+            {
+                // Compact entries know their own length, the exit still needs its empty kinds
+                return Crypt(bytes.Length == 1 ? new byte[] { bytes[0], 0 } : bytes, index);
+            }
+
+            var encoded = Crypt(bytes, index).ToList();
+            encoded.Insert(0, (byte)encoded.Count);
+            return encoded.ToArray();
+        }
+
+        private static bool IsRead(OpAccess access)
+        {
+            return access == OpAccess.Read || access == OpAccess.CondRead || access == OpAccess.ReadWrite || access == OpAccess.ReadCondWrite;
+        }
+
+        private static bool IsWrite(OpAccess access)
+        {
+            return access == OpAccess.Write || access == OpAccess.CondWrite || access == OpAccess.ReadWrite || access == OpAccess.ReadCondWrite;
+        }
+
+        // Collects the registers a region touches and writes and whether it needs the flags it was entered with
+        private (HashSet<VMRegister> Touched, HashSet<VMRegister> Written, bool ReadsFlags) GetUsage(List<Instruction> region)
+        {
+            var touched = new HashSet<VMRegister>();
+            var written = new HashSet<VMRegister>();
+            bool? readsFlags = null;
+
+            foreach (var instr in region)
+            {
+                foreach (var used in _info.GetInfo(instr).GetUsedRegisters())
+                {
+                    if (!used.Register.IsGPR())
+                    {
+                        continue;
+                    }
+
+                    var reg = ToVMRegister(used.Register.GetFullRegister());
+                    touched.Add(reg);
+
+                    if (IsWrite(used.Access))
+                    {
+                        written.Add(reg);
+                    }
+                }
+
+                // The entry flags are dead once all of them are overwritten before anything reads them or branches
+                if (readsFlags == null)
+                {
+                    if ((instr.RflagsRead & STATUS_FLAGS) != 0 || instr.FlowControl != FlowControl.Next)
+                    {
+                        readsFlags = true;
+                    }
+                    else if ((instr.RflagsModified & STATUS_FLAGS) == STATUS_FLAGS)
+                    {
+                        readsFlags = false;
+                    }
+                }
+            }
+            return (touched, written, readsFlags ?? false);
+        }
+
+        // Scans the native code the region falls through to, a register or the flags are dead there once they are
+        // overwritten before being read, anything still undecided at control flow or the end of the window stays live
+        private (HashSet<VMRegister> Registers, bool Flags) GetLiveOut(List<Instruction> instrs, Dictionary<ulong, int> positions, List<Instruction> region)
+        {
+            var live = Enum.GetValues<VMRegister>().ToHashSet();
+
+            // Returns leave the region somewhere else entirely
+            if (region.Any(x => x.FlowControl == FlowControl.Return))
+            {
+                return (live, true);
+            }
+
+            var read = new HashSet<VMRegister>();
+            var dead = new HashSet<VMRegister>();
+            bool? flags = null;
+
+            if (!positions.TryGetValue(region.Last().NextIP, out int start))
+            {
+                return (live, true);
+            }
+
+            for (int i = start; i < instrs.Count && i < start + LIVENESS_WINDOW; i++)
+            {
+                var instr = instrs[i];
+                var usedRegisters = _info.GetInfo(instr).GetUsedRegisters().Where(x => x.Register.IsGPR()).ToList();
+
+                foreach (var used in usedRegisters.Where(x => IsRead(x.Access)))
+                {
+                    var reg = ToVMRegister(used.Register.GetFullRegister());
+
+                    if (!dead.Contains(reg))
+                    {
+                        read.Add(reg);
+                    }
+                }
+
+                // Only full and 32 bit writes replace the whole register, smaller ones keep the rest of it
+                foreach (var used in usedRegisters.Where(x => x.Access == OpAccess.Write && x.Register.GetSize() >= 4))
+                {
+                    var reg = ToVMRegister(used.Register.GetFullRegister());
+
+                    if (!read.Contains(reg))
+                    {
+                        dead.Add(reg);
+                    }
+                }
+
+                if (flags == null)
+                {
+                    if ((instr.RflagsRead & STATUS_FLAGS) != 0)
+                    {
+                        flags = true;
+                    }
+                    else if ((instr.RflagsModified & STATUS_FLAGS) == STATUS_FLAGS)
+                    {
+                        flags = false;
+                    }
+                }
+
+                if (instr.FlowControl != FlowControl.Next)
+                {
+                    break;
+                }
+            }
+
+            live.ExceptWith(dead);
+            return (live, flags ?? true);
+        }
+
+        // Builds the VMState on the stack, runs the region and moves the state back. Only the registers the region touches
+        // and the volatile ones still needed afterwards are spilled, the flags are only saved and restored when they are used
+        private uint EmitEntry(Compiler compiler, List<Instruction> region, List<Instruction> instrs, Dictionary<ulong, int> positions, int index, uint bytecode, uint dispatcher)
         {
-            Console.WriteLine("Virtualizing: {0}", instr);
+            var usage = GetUsage(region);
+            var liveOut = GetLiveOut(instrs, positions, region);
+
+            // RSP and RBP are always moved since the stub builds its frames with them
+            var spills = usage.Touched.Union(VolatileRegisters.Intersect(liveOut.Registers))
+                .Where(x => x != VMRegister.RSP && x != VMRegister.RBP)
+                .OrderBy(x => x)
+                .ToList();
+
+            var reloads = liveOut.Registers.Intersect(usage.Written.Union(VolatileRegisters))
+                .Where(x => x != VMRegister.RSP && x != VMRegister.RBP)
+                .OrderBy(x => x)
+                .ToList();
+
+            bool restoreFlags = liveOut.Flags;
+            bool saveFlags = usage.ReadsFlags || restoreFlags;
+
+            Console.WriteLine("Entry: {0} spilled, {1} reloaded, flags {2}", spills.Count, reloads.Count, restoreFlags ? "restored" : saveFlags ? "saved" : "dead");
 
             Assembler ass = new Assembler(64);
 
-            // VMEntry returns the address to the beginning of VMState
-            ass.call(entry);
+            // [rbp] rbp [rbp + 8] rflags [rbp + 16] return address, the guest stack starts right above
+            if (saveFlags)
+            {
+                ass.pushfq();
+            }
+            else
+            {
+                ass.lea(rsp, __[rsp - 8]);
+            }
+            ass.push(rbp);
+            ass.mov(rbp, rsp);
 
-            ass.mov(rcx, rax);
+            ass.sub(rsp, STATE_SIZE);
+            ass.and(rsp, -64);
 
-            ass.push(rcx);
+            // RAX comes first since it is used as scratch afterwards
+            foreach (var reg in spills)
+            {
+                ass.mov(__[rsp + (int)reg * 8], StateRegisters[(int)reg]);
+            }
 
-            ass.AddInstruction(Instruction.Create(Code.Lea_r64_m, rdx,
+            ass.lea(rax, __[rbp + 24]);
+            ass.mov(__[rsp + (int)VMRegister.RSP * 8], rax);
+            ass.mov(rax, __[rbp]);
+            ass.mov(__[rsp + (int)VMRegister.RBP * 8], rax);
+
+            if (saveFlags)
+            {
+                ass.mov(rax, __[rbp + 8]);
+                ass.mov(__[rsp + STATE_RFLAGS], rax);
+            }
+            ass.mov(rax, __[rbp + 16]);
+            ass.mov(__[rsp + STATE_RIP], rax);
+
+            ass.mov(rcx, rsp);
+            ass.AddInstruction(Instruction.Create(Code.Lea_r64_m, Register.RDX,
                 new MemoryOperand(Register.RIP, Register.None, 1, bytecode, 1)));
             ass.mov(r8d, index);
+            ass.sub(rsp, 32);
             ass.call(dispatcher);
+            ass.add(rsp, 32);
+
+            // Build the exit frame below the final guest stack [rsp - 8] rip [rsp - 16] rflags [rsp - 24] rbp
+            ass.mov(rax, __[rsp + (int)VMRegister.RSP * 8]);
+            ass.mov(rcx, __[rsp + STATE_RIP]);
+            ass.mov(__[rax - 8], rcx);
+
+            if (restoreFlags)
+            {
+                ass.mov(rcx, __[rsp + STATE_RFLAGS]);
+                ass.mov(__[rax - 16], rcx);
+            }
+            ass.mov(rcx, __[rsp + (int)VMRegister.RBP * 8]);
+            ass.mov(__[rax - 24], rcx);
+            ass.lea(rbp, __[rax - 24]);
+
+            foreach (var reg in reloads.Where(x => x != VMRegister.RAX))
+            {
+                ass.mov(StateRegisters[(int)reg], __[rsp + (int)reg * 8]);
+            }
 
-            ass.pop(rcx);
+            if (reloads.Contains(VMRegister.RAX))
+            {
+                ass.mov(rax, __[rsp]);
+            }
+
+            ass.mov(rsp, rbp);
+            ass.pop(rbp);
+
+            if (restoreFlags)
+            {
+                ass.popfq();
+            }
+            else
+            {
+                ass.lea(rsp, __[rsp + 8]);
+            }
+            ass.ret();
 
-            ass.call(exit);
+            return compiler.Injector.Insert("VMEntry" + index, ass);
+        }
+
+        private void Virtualize(Compiler compiler, List<Instruction> region, uint oldSectionRVA, uint newSectionRVA, uint entry)
+        {
+            foreach (var instr in region)
+            {
+                Console.WriteLine("Virtualizing: {0}", instr);
+            }
+
+            var first = region.First();
+            var last = region.Last();
+
+            int offset = (int)(first.IP - newSectionRVA);
+            int length = (int)(last.NextIP - first.IP);
+
+            Assembler ass = new Assembler(64);
+
+            // The entry stub of the region knows its bytecode and index so the call site is a plain call
+            ass.call(entry);
 
             using (var ms = new MemoryStream())
             {
-                ass.Assemble(new StreamCodeWriter(ms), instr.IP - (newSectionRVA - oldSectionRVA));
+                ass.Assemble(new StreamCodeWriter(ms), first.IP - (newSectionRVA - oldSectionRVA));
                 byte[] assembled = ms.ToArray();
-                compiler.Replace(offset, instr.Length, assembled);
+                compiler.Replace(offset, length, assembled);
             }
         }
 
-        private bool IsSupported(Instruction instr)
+        // Maps every branch or reference target to the instructions referencing it
+        private Dictionary<ulong, List<ulong>> GetReferences(List<Instruction> instrs)
         {
-            if (instr.MemoryBase != Register.RIP && instr.MemoryBase != Register.RBP && instr.MemoryBase != Register.RSP &&
-                instr.Op0Register != Register.RSP && instr.Op0Register != Register.RBP &&
-                instr.Op1Register != Register.RSP && instr.Op1Register != Register.RBP &&
-                (instr.Mnemonic == Mnemonic.Add || instr.Mnemonic == Mnemonic.Sub))
+            var references = new Dictionary<ulong, List<ulong>>();
+
+            foreach (var instr in instrs)
             {
+                if (!instr.IsIPRelative())
+                {
+                    continue;
+                }
+
+                ulong target = instr.IsIPRelativeMemoryOperand ? instr.IPRelativeMemoryAddress : instr.NearBranchTarget;
+
+                if (!references.ContainsKey(target))
+                {
+                    references.Add(target, new List<ulong>());
+                }
+                references[target].Add(instr.IP);
+            }
+            return references;
+        }
+
+        private bool IsControlFlow(Instruction instr)
+        {
+            return instr.IsJccShortOrNear || instr.IsJmpShortOrNear || instr.Code == Code.Retnq;
+        }
+
+        // Splits a region at the first instruction that is reached from outside of it or branches outside of it
+        private bool Split(List<List<Instruction>> regions, List<Instruction> region, Dictionary<ulong, List<ulong>> references)
+        {
+            var ips = region.Select(x => x.IP).ToHashSet();
+
+            for (int i = 0; i < region.Count; i++)
+            {
+                var instr = region[i];
+
+                bool entered = i > 0 && references.ContainsKey(instr.IP) && references[instr.IP].Any(x => !ips.Contains(x));
+                bool leaves = (instr.IsJccShortOrNear || instr.IsJmpShortOrNear) && !ips.Contains(instr.NearBranchTarget);
+
+                if (!entered && !leaves)
+                {
+                    continue;
+                }
+
+                int index = regions.IndexOf(region);
+                regions.RemoveAt(index);
+
+                // A branch leaving the region stays native, an entered instruction starts a new region
+                var tail = region.Skip(leaves ? i + 1 : i).ToList();
+                var head = region.Take(i).ToList();
+
+                if (tail.Count > 0)
+                {
+                    regions.Insert(index, tail);
+                }
+
+                if (head.Count > 0)
+                {
+                    regions.Insert(index, head);
+                }
                 return true;
-            } 
+            }
             return false;
         }
 
-        public void Execute(Compiler compiler, uint oldSectionRVA, uint newSectionRVA, byte[] code)
+        // Groups consecutive supported instructions so they share a single VM entry and exit, branches between
+        // them stay inside the VM so a loop or a whole function runs in one activation
+        private List<List<Instruction>> GetRegions(Compiler compiler, List<Instruction> instrs, uint newSectionRVA)
         {
-            var instrs = compiler.GetInstructions(code, newSectionRVA);
+            var references = GetReferences(instrs);
+            var functions = compiler.GetFunctions(newSectionRVA);
+            var starts = functions.Select(x => x.Begin).ToHashSet();
 
-            var converted = new Dictionary<int, byte[]>();
+            var regions = new List<List<Instruction>>();
+
+            List<Instruction>? region = null;
 
             foreach (var instr in instrs)
             {
-                int offset = (int)(instr.IP - newSectionRVA);
+                if (!IsSupported(instr))
+                {
+                    region = null;
+                    continue;
+                }
 
-                if (IsSupported(instr))
+                if (region == null || starts.Contains(instr.IP) || region.Last().NextIP != instr.IP)
                 {
-                    // Convert the instruction to byte code format [opcode] [operands]
-                    int index = converted
-                        .Where(x => x.Key < offset)
-                        .Sum(x => x.Value.Length);
-                    var bytes = Crypt(Convert(index, instr), index).ToList();
-                    bytes.Insert(0, (byte)bytes.Count);
-                    converted.Add(offset, bytes.ToArray());
+                    region = new List<Instruction>();
+                    regions.Add(region);
                 }
+                region.Add(instr);
             }
 
-            uint bytecode = compiler.Injector.Insert("VMBytecode", converted
-                .SelectMany(x => x.Value)
-                .ToArray());
+            // Keep splitting until every branch stays inside its region and nothing jumps into the middle of one
+            bool split = true;
 
-            uint entry = compiler.Injector.Inject("VMEntry");
-            uint dispatcher = compiler.Injector.Inject("VMDispatcher");
-            uint exit = compiler.Injector.Inject("VMExit");
+            while (split)
+            {
+                split = regions.ToList().Any(x => Split(regions, x, references));
+            }
 
-            foreach (var instr in instrs)
+            regions.RemoveAll(x => x.All(IsControlFlow));
+
+            foreach (var function in functions)
             {
-                int offset = (int)(instr.IP - newSectionRVA);
+                if (regions.Any(x => x.First().IP == function.Begin && x.Last().NextIP == function.End))
+                {
+                    Console.WriteLine("Virtualizing function: {0:X}", function.Begin);
+                }
+            }
+            return regions;
+        }
+
+        private bool IsSupportedOperand(Instruction instr, int operand)
+        {
+            OpKind kind = instr.GetOpKind(operand);
 
-                if (IsSupported(instr))
+            if (kind == OpKind.Register)
+            {
+                Register reg = instr.GetOpRegister(operand);
+                return reg.IsGPR() && reg.GetFullRegister() != Register.RSP && reg.GetFullRegister() != Register.RBP;
+            }
+            else if (kind == OpKind.Memory)
+            {
+                if (instr.SegmentPrefix != Register.None)
                 {
-                    int index = converted
-                            .Where(x => x.Key < offset)
-                            .Sum(x => x.Value.Length);
-                    Virtualize(compiler, instr, oldSectionRVA, newSectionRVA, offset, index, bytecode, entry, dispatcher, exit);
+                    return false;
                 }
+
+                // The runtime rebases RIP relative operands onto the image, code moves afterwards so only data can be reached that way
+                if (instr.IsIPRelativeMemoryOperand)
+                {
+                    ulong target = instr.IPRelativeMemoryAddress;
+                    return target < _code.Begin || target >= _code.End;
+                }
+
+                long displacement = (long)instr.MemoryDisplacement64;
+
+                return (instr.MemoryBase == Register.None || instr.MemoryBase.IsGPR64()) &&
+                    (instr.MemoryIndex == Register.None || instr.MemoryIndex.IsGPR64()) &&
+                    displacement >= int.MinValue && displacement <= int.MaxValue;
+            }
+            return kind.IsImmediate();
+        }
+
+        private bool IsSupported(Instruction instr)
+        {
+            if (IsControlFlow(instr))
+            {
+                return true;
+            }
+
+            if (instr.HasLockPrefix)
+            {
+                return false;
+            }
+
+            switch (instr.Mnemonic)
+            {
+                case Mnemonic.Add:
+                case Mnemonic.Sub:
+                case Mnemonic.Cmp:
+                case Mnemonic.Mov:
+                    break;
+
+                default:
+                    return false;
+            }
+
+            for (int i = 0; i < instr.OpCount; i++)
+            {
+                if (!IsSupportedOperand(instr, i))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        public void Execute(Compiler compiler, uint oldSectionRVA, uint newSectionRVA, byte[] code)
+        {
+            _code = (newSectionRVA, newSectionRVA + (ulong)code.Length);
+
+            var instrs = compiler.GetInstructions(code, newSectionRVA);
+            var regions = GetRegions(compiler, instrs, newSectionRVA);
+
+            _opcodes = ShuffleOpcodes();
+            _targets.Clear();
+
+            _descriptors.Clear();
+
+            // Lay out the bytecode first so branches know the index of their target
+            // Compact entries grow with their targets so the layout is repeated until no target moves anymore
+            bool moved = true;
+
+            while (moved)
+            {
+                int layout = HEADER_SIZE;
+                moved = false;
+
+                foreach (var region in regions)
+                {
+                    for (int i = 0; i < region.Count; i++)
+                    {
+                        moved |= _targets.GetValueOrDefault(region[i].IP, -1) != layout;
+                        _targets[region[i].IP] = layout;
+                        layout += Encode(layout, Convert(layout, region[i], i + 1 < region.Count ? region[i + 1] : null)).Length;
+                    }
+                    layout += Encode(layout, new byte[] { _opcodes[(int)VMOpcode.Exit] }).Length;
+                }
+                _pool.Clear();
+            }
+
+            var bytes = new List<byte>(GetHeader());
+            var indices = new List<int>();
+
+            foreach (var region in regions)
+            {
+                // Convert the region to byte code format [opcode] [operands] for each instruction followed by an exit
+                indices.Add(bytes.Count);
+
+                for (int i = 0; i < region.Count; i++)
+                {
+                    bytes.AddRange(Encode(bytes.Count, Convert(bytes.Count, region[i], i + 1 < region.Count ? region[i + 1] : null)));
+                }
+                bytes.AddRange(Encode(bytes.Count, new byte[] { _opcodes[(int)VMOpcode.Exit] }));
+            }
+
+            // The constant pool or descriptor table follows the entries, every slot is keyed on its number
+            int pool = bytes.Count;
+
+            for (int i = 0; i < _pool.Count; i++)
+            {
+                bytes.AddRange(Crypt(BitConverter.GetBytes(_pool[i]), i));
+            }
+
+            foreach (var descriptor in _descriptors.OrderBy(x => x.Value))
+            {
+                bytes.AddRange(Crypt(new byte[] { descriptor.Key.Base, descriptor.Key.Index, descriptor.Key.Scale }, descriptor.Value));
+            }
+
+            BitConverter.GetBytes(pool).CopyTo(bytes, HEADER_POOL);
+
+            uint bytecode = compiler.Injector.Insert("VMBytecode", bytes.ToArray());
+
+            uint dispatcher = compiler.Injector.Inject("VMDispatcher");
+
+            var positions = instrs.Select((x, i) => (x.IP, i)).ToDictionary(x => x.IP, x => x.i);
+
+            for (int i = 0; i < regions.Count; i++)
+            {
+                uint entry = EmitEntry(compiler, regions[i], instrs, positions, indices[i], bytecode, dispatcher);
+                Virtualize(compiler, regions[i], oldSectionRVA, newSectionRVA, entry);
             }
         }
     }
@@ -39,6 +39,16 @@ namespace radon_vm {
             return symbols.First(x => (x.Address - x.ModBase) == address).Name;
         }
 
+        // Finds the symbol an address points into, used for references to fields of globals
+        public static SymbolInfo GetSymbol(ulong address)
+        {
+            var symbols = GetAllSymbolsFromPdb(DLL_NAME);
+            return symbols
+                .Where(x => address >= x.Address - x.ModBase && address < x.Address - x.ModBase + Math.Max(x.Size, 1))
+                .OrderByDescending(x => x.Size)
+                .First();
+        }
+
         private static IReadOnlyCollection<SymbolInfo> GetAllSymbolsFromPdb(string path) {
             var symbols = new List<SymbolInfo>();
 